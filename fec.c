@@ -49,6 +49,73 @@
 #include <string.h>
 #include <stdint.h>
 
+/*
+ * SIMD kernels for addmul() are only built for GF(2^8) where a product
+ * fits in a byte. Which one runs is decided at runtime in init_fec().
+ */
+#if (GF_BITS == 8) && (defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86))
+#define FEC_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define FEC_TARGET(isa)
+#else
+#define FEC_TARGET(isa) __attribute__((target(isa)))
+#endif
+#elif (GF_BITS == 8) && (defined(__aarch64__) || defined(_M_ARM64))
+#define FEC_NEON
+#include <arm_neon.h>
+#endif
+
+/*
+ * Threading primitives. Everything has a static initializer so no lock
+ * ever needs setting up before first use.
+ */
+#if defined(_WIN32)
+#include <windows.h>
+typedef SRWLOCK fec_mutex_t ;
+typedef CONDITION_VARIABLE fec_cond_t ;
+typedef INIT_ONCE fec_once_t ;
+#define FEC_MUTEX_INIT		SRWLOCK_INIT
+#define FEC_COND_INIT		CONDITION_VARIABLE_INIT
+#define FEC_ONCE_INIT		INIT_ONCE_STATIC_INIT
+#define fec_mutex_lock(m)	AcquireSRWLockExclusive(m)
+#define fec_mutex_trylock(m)	TryAcquireSRWLockExclusive(m)
+#define fec_mutex_unlock(m)	ReleaseSRWLockExclusive(m)
+#define fec_cond_wait(c, m)	SleepConditionVariableSRW(c, m, INFINITE, 0)
+#define fec_cond_broadcast(c)	WakeAllConditionVariable(c)
+#define fec_once(o, f)		InitOnceExecuteOnce(o, fec_once_proc, (PVOID) (f), NULL)
+#define fec_atomic_inc(p)	(InterlockedIncrement(p) - 1)
+#define fec_atomic_load(p)	(*(volatile long *)(p))
+#define fec_atomic_store(p, v)	InterlockedExchange(p, v)
+#define FEC_THREAD_PROC		DWORD WINAPI
+static BOOL CALLBACK
+fec_once_proc(PINIT_ONCE once, PVOID f, PVOID *context)
+{
+    ((void (*)(void)) f)() ;
+    return TRUE ;
+}
+#else
+#include <pthread.h>
+#include <unistd.h>
+typedef pthread_mutex_t fec_mutex_t ;
+typedef pthread_cond_t fec_cond_t ;
+typedef pthread_once_t fec_once_t ;
+#define FEC_MUTEX_INIT		PTHREAD_MUTEX_INITIALIZER
+#define FEC_COND_INIT		PTHREAD_COND_INITIALIZER
+#define FEC_ONCE_INIT		PTHREAD_ONCE_INIT
+#define fec_mutex_lock(m)	pthread_mutex_lock(m)
+#define fec_mutex_trylock(m)	(pthread_mutex_trylock(m) == 0)
+#define fec_mutex_unlock(m)	pthread_mutex_unlock(m)
+#define fec_cond_wait(c, m)	pthread_cond_wait(c, m)
+#define fec_cond_broadcast(c)	pthread_cond_broadcast(c)
+#define fec_once(o, f)		pthread_once(o, f)
+#define fec_atomic_inc(p)	__atomic_fetch_add(p, 1, __ATOMIC_RELAXED)
+#define fec_atomic_load(p)	__atomic_load_n(p, __ATOMIC_RELAXED)
+#define fec_atomic_store(p, v)	__atomic_store_n(p, v, __ATOMIC_RELAXED)
+#define FEC_THREAD_PROC		void *
+#endif
+
 typedef unsigned long u_long;
 /*
  * compatibility stuff
@@ -162,6 +229,10 @@ static const char *allPp[] = {    /* GF_BITS	polynomial		*/
  * In any case the macro gf_mul(x,y) takes care of multiplications.
  */
 
+/*
+ * The tables below are filled in exactly once by init_fec() and are
+ * read-only afterwards, so any number of threads can use them.
+ */
 static gf gf_exp[2*GF_SIZE];	/* index->poly form conversion table	*/
 static int gf_log[GF_SIZE + 1];	/* Poly->index form conversion table	*/
 static gf inverse[GF_SIZE+1];	/* inverse of field elem.		*/
@@ -202,6 +273,16 @@ static gf gf_mul_table[GF_SIZE + 1][GF_SIZE + 1];
 #define GF_MULC0(c) __gf_mulc_ = gf_mul_table[c]
 #define GF_ADDMULC(dst, x) dst ^= __gf_mulc_[x]
 
+/*
+ * Multiplication by c is linear over XOR so c*x = c*(x & 0x0f) ^ c*(x & 0xf0).
+ * gf_mul_lo[c] and gf_mul_hi[c] hold the 16 products for each nibble, which
+ * is exactly one PSHUFB/TBL lookup table.
+ */
+#if (GF_BITS == 8)
+static gf gf_mul_lo[GF_SIZE + 1][16];
+static gf gf_mul_hi[GF_SIZE + 1][16];
+#endif
+
 static void
 init_mul_table()
 {
@@ -212,6 +293,14 @@ init_mul_table()
 
     for (j=0; j< GF_SIZE+1; j++)
 	    gf_mul_table[0][j] = gf_mul_table[j][0] = 0;
+
+#if (GF_BITS == 8)
+    for (i=0; i< GF_SIZE+1; i++)
+	for (j=0; j< 16; j++) {
+	    gf_mul_lo[i][j] = gf_mul_table[i][j] ;
+	    gf_mul_hi[i][j] = gf_mul_table[i][j << 4] ;
+	}
+#endif
 }
 #else	/* GF_BITS > 8 */
 static inline gf
@@ -337,7 +426,7 @@ generate_gf(void)
  * Note that gcc on
  */
 #define addmul(dst, src, c, sz) \
-    if (c != 0) addmul1(dst, src, c, sz)
+    if (c != 0) addmul_kernel(dst, src, c, sz)
 
 #define UNROLL 16 /* 1, 4, 8, 16 */
 static void
@@ -378,6 +467,168 @@ addmul1(gf *dst1, gf *src1, gf c, int sz)
 	GF_ADDMULC( *dst , *src );
 }
 
+/*
+ * Split nibble versions of addmul1(). Each 16 (32 for AVX2) byte chunk
+ * looks up both nibbles of every byte in parallel and XORs the halves
+ * together. Whatever doesn't fill a vector goes through addmul1().
+ */
+#ifdef FEC_X86
+FEC_TARGET("ssse3") static void
+addmul_ssse3(gf *dst, gf *src, gf c, int sz)
+{
+    const __m128i lo = _mm_loadu_si128((const __m128i *) gf_mul_lo[c]);
+    const __m128i hi = _mm_loadu_si128((const __m128i *) gf_mul_hi[c]);
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    int i = 0;
+
+    for (; i + 16 <= sz; i += 16) {
+	__m128i x = _mm_loadu_si128((const __m128i *) (src + i));
+	__m128i d = _mm_loadu_si128((const __m128i *) (dst + i));
+	__m128i p = _mm_xor_si128(
+	    _mm_shuffle_epi8(lo, _mm_and_si128(x, mask)),
+	    _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi64(x, 4), mask)));
+	_mm_storeu_si128((__m128i *) (dst + i), _mm_xor_si128(d, p));
+    }
+    if (i < sz)
+	addmul1(dst + i, src + i, c, sz - i);
+}
+
+FEC_TARGET("avx2") static void
+addmul_avx2(gf *dst, gf *src, gf c, int sz)
+{
+    const __m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) gf_mul_lo[c]));
+    const __m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) gf_mul_hi[c]));
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    int i = 0;
+
+    for (; i + 32 <= sz; i += 32) {
+	__m256i x = _mm256_loadu_si256((const __m256i *) (src + i));
+	__m256i d = _mm256_loadu_si256((const __m256i *) (dst + i));
+	__m256i p = _mm256_xor_si256(
+	    _mm256_shuffle_epi8(lo, _mm256_and_si256(x, mask)),
+	    _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi64(x, 4), mask)));
+	_mm256_storeu_si256((__m256i *) (dst + i), _mm256_xor_si256(d, p));
+    }
+    if (i < sz)
+	addmul1(dst + i, src + i, c, sz - i);
+}
+
+static int
+cpu_has_ssse3(void)
+{
+#if defined(_MSC_VER)
+    int r[4];
+    __cpuid(r, 1);
+    return (r[2] >> 9) & 1;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("ssse3");
+#endif
+}
+
+static int
+cpu_has_avx2(void)
+{
+#if defined(_MSC_VER)
+    int r[4];
+    __cpuid(r, 0);
+    if (r[0] < 7)
+	return 0;
+    __cpuid(r, 1);
+    if (!((r[2] >> 27) & 1) || (_xgetbv(0) & 6) != 6) /* OS has to save the YMM registers */
+	return 0;
+    __cpuidex(r, 7, 0);
+    return (r[1] >> 5) & 1;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif /* FEC_X86 */
+
+#ifdef FEC_NEON
+static void
+addmul_neon(gf *dst, gf *src, gf c, int sz)
+{
+    const uint8x16_t lo = vld1q_u8(gf_mul_lo[c]);
+    const uint8x16_t hi = vld1q_u8(gf_mul_hi[c]);
+    const uint8x16_t mask = vdupq_n_u8(0x0f);
+    int i = 0;
+
+    for (; i + 16 <= sz; i += 16) {
+	uint8x16_t x = vld1q_u8(src + i);
+	uint8x16_t p = veorq_u8(vqtbl1q_u8(lo, vandq_u8(x, mask)),
+				vqtbl1q_u8(hi, vshrq_n_u8(x, 4)));
+	vst1q_u8(dst + i, veorq_u8(vld1q_u8(dst + i), p));
+    }
+    if (i < sz)
+	addmul1(dst + i, src + i, c, sz - i);
+}
+#endif /* FEC_NEON */
+
+/*
+ * Kernel selection. init_fec() picks the widest kernel the CPU supports,
+ * fec_set_kernel() can override that for benchmarking. Only the index is
+ * shared between threads, the kernels themselves never change.
+ */
+static void (* const addmul_kernels[FEC_KERNEL_COUNT])(gf *dst, gf *src, gf c, int sz) = {
+    addmul1,
+#ifdef FEC_X86
+    addmul_ssse3,
+    addmul_avx2,
+#else
+    addmul1,
+    addmul1,
+#endif
+#ifdef FEC_NEON
+    addmul_neon,
+#else
+    addmul1,
+#endif
+} ;
+static long addmul_kernel_id = FEC_KERNEL_TABLE ;
+#define addmul_kernel addmul_kernels[fec_atomic_load(&addmul_kernel_id)]
+
+int
+fec_kernel_supported(int kernel)
+{
+    switch (kernel) {
+    case FEC_KERNEL_TABLE: return 1 ;
+#ifdef FEC_X86
+    case FEC_KERNEL_SSSE3: return cpu_has_ssse3() ;
+    case FEC_KERNEL_AVX2: return cpu_has_avx2() ;
+#endif
+#ifdef FEC_NEON
+    case FEC_KERNEL_NEON: return 1 ;
+#endif
+    default: return 0 ;
+    }
+}
+
+const char *
+fec_kernel_name(int kernel)
+{
+    static const char *names[FEC_KERNEL_COUNT] = { "Table", "SSSE3", "AVX2", "NEON" } ;
+    return kernel >= 0 && kernel < FEC_KERNEL_COUNT ? names[kernel] : "Unknown" ;
+}
+
+int
+fec_get_kernel(void)
+{
+    init_fec() ;
+    return (int) fec_atomic_load(&addmul_kernel_id) ;
+}
+
+int
+fec_set_kernel(int kernel)
+{
+    init_fec() ;	/* so the first fec_new() doesn't override us */
+    if (!fec_kernel_supported(kernel))
+	return 1 ;
+    fec_atomic_store(&addmul_kernel_id, kernel) ;
+    return 0 ;
+}
+
 /*
  * computes C = AB where A is n*k, B is k*m, C is n*m
  */
@@ -619,10 +870,12 @@ invert_vdm(gf *src, int k)
     return 0 ;
 }
 
-static int fec_initialized = 0 ;
-void
-init_fec()
+static fec_once_t fec_initialized = FEC_ONCE_INIT ;
+static void
+init_fec_once(void)
 {
+    int kernel ;
+
     TICK(ticks[0]);
     generate_gf();
     TOCK(ticks[0]);
@@ -631,7 +884,19 @@ init_fec()
     init_mul_table();
     TOCK(ticks[0]);
     DDB(fprintf(stderr, "init_mul_table took %ldus\n", ticks[0]);)
-    fec_initialized = 1 ;
+    for (kernel = FEC_KERNEL_COUNT - 1; !fec_kernel_supported(kernel); kernel--)
+	;	/* the table kernel always works */
+    fec_atomic_store(&addmul_kernel_id, kernel) ;
+}
+
+/*
+ * Safe to call from any number of threads, only the first call does
+ * any work and the others wait for it to finish.
+ */
+void
+init_fec()
+{
+    fec_once(&fec_initialized, init_fec_once) ;
 }
 
 /*
@@ -648,6 +913,86 @@ struct fec_parms {
     gf *enc_matrix ;
 } ;
 
+/*
+ * Building an encoding matrix is O(k^2 n) and inverting a decode matrix
+ * O(k^3), far more than coding the packets themselves. Callers create a
+ * code per transfer and decode many packet groups that lost the same
+ * blocks, so recently built matrices are kept in small LRU caches and
+ * copied out on a hit. The caches are shared by every thread; the mutex
+ * is only held while copying, never while building a matrix.
+ */
+#define FEC_ENC_CACHE_SIZE	8	/* keyed by (k, n) */
+#define FEC_DEC_CACHE_SIZE	16	/* keyed by (k, n, received indexes) */
+
+struct fec_cache_entry {
+    int k, n ;
+    int *index ;	/* decode only: indexes of the received packets after shuffle() */
+    gf *matrix ;
+    unsigned long last_used ;	/* 0 if the entry is empty */
+} ;
+
+static struct fec_cache_entry enc_cache[FEC_ENC_CACHE_SIZE] ;
+static struct fec_cache_entry dec_cache[FEC_DEC_CACHE_SIZE] ;
+static unsigned long cache_clock ;
+
+static fec_mutex_t cache_mutex = FEC_MUTEX_INIT ;
+
+/*
+ * copies the matching cached matrix of "elements" entries into out.
+ * index is NULL for the encoder cache. Returns 1 on a hit.
+ */
+static int
+cache_get(struct fec_cache_entry *cache, int entries, int k, int n,
+	int index[], gf *out, int elements)
+{
+    int i, hit = 0 ;
+
+    fec_mutex_lock(&cache_mutex) ;
+    for (i = 0 ; i < entries ; i++) {
+	if (cache[i].last_used && cache[i].k == k && cache[i].n == n &&
+	    (index == NULL || memcmp(cache[i].index, index, k*sizeof(int)) == 0)) {
+	    bcopy(cache[i].matrix, out, elements*sizeof(gf)) ;
+	    cache[i].last_used = ++cache_clock ;
+	    hit = 1 ;
+	    break ;
+	}
+    }
+    fec_mutex_unlock(&cache_mutex) ;
+    return hit ;
+}
+
+/*
+ * stores a copy of matrix in place of the least recently used entry
+ */
+static void
+cache_put(struct fec_cache_entry *cache, int entries, int k, int n,
+	int index[], gf *matrix, int elements)
+{
+    int i, lru = 0 ;
+    gf *matrix_copy = NEW_GF_MATRIX(elements, 1) ;
+    int *index_copy = NULL ;
+
+    bcopy(matrix, matrix_copy, elements*sizeof(gf)) ;
+    if (index != NULL) {
+	index_copy = (int *)my_malloc(k*sizeof(int), "cache index") ;
+	bcopy(index, index_copy, k*sizeof(int)) ;
+    }
+
+    fec_mutex_lock(&cache_mutex) ;
+    for (i = 1 ; i < entries ; i++)
+	if (cache[i].last_used < cache[lru].last_used)
+	    lru = i ;
+    SWAP(cache[lru].matrix, matrix_copy, gf *) ;
+    SWAP(cache[lru].index, index_copy, int *) ;
+    cache[lru].k = k ;
+    cache[lru].n = n ;
+    cache[lru].last_used = ++cache_clock ;
+    fec_mutex_unlock(&cache_mutex) ;
+
+    free(matrix_copy) ;	/* whatever we evicted */
+    free(index_copy) ;
+}
+
 void
 fec_free(void *p0)
 {
@@ -673,8 +1018,7 @@ fec_new(int k, int n)
 
     struct fec_parms *retval ;
 
-    if (fec_initialized == 0)
-	init_fec();
+    init_fec();
 
     if (k > GF_SIZE + 1 || n > GF_SIZE + 1 || k > n ) {
 	fprintf(stderr, "Invalid parameters k %d n %d GF_SIZE %d\n",
@@ -686,6 +1030,8 @@ fec_new(int k, int n)
     retval->n = n ;
     retval->enc_matrix = NEW_GF_MATRIX(n, k);
     retval->magic = ( ( FEC_MAGIC ^ k) ^ n) ^ (int)((intptr_t)retval->enc_matrix) ;
+    if (cache_get(enc_cache, FEC_ENC_CACHE_SIZE, k, n, NULL, retval->enc_matrix, n*k))
+	return retval ;
     tmp_m = NEW_GF_MATRIX(n, k);
     /*
      * fill the matrix with powers of field elements, starting from 0.
@@ -715,6 +1061,7 @@ fec_new(int k, int n)
 	*p = 1 ;
     free(tmp_m);
     TOCK(ticks[3]);
+    cache_put(enc_cache, FEC_ENC_CACHE_SIZE, k, n, NULL, retval->enc_matrix, n*k);
 
     DDB(fprintf(stderr, "--- %ld us to build encoding matrix\n",
 	    ticks[3]);)
@@ -818,11 +1165,14 @@ build_decode_matrix(struct fec_parms *code, gf *pkt[], int index[])
 	    return NULL ;
 	}
     }
+    if (cache_get(dec_cache, FEC_DEC_CACHE_SIZE, k, code->n, index, matrix, k*k))
+	return matrix ;
     TICK(ticks[9]);
     if (invert_mat(matrix, k)) {
 	free(matrix);
 	matrix = NULL ;
-    }
+    } else
+	cache_put(dec_cache, FEC_DEC_CACHE_SIZE, k, code->n, index, matrix, k*k);
     TOCK(ticks[9]);
     return matrix ;
 }
@@ -853,6 +1203,10 @@ fec_decode(void *code0, void *pkt0[], int index[], int sz)
 
     if (shuffle(pkt, index, k))	/* error if true */
 	return 1 ;
+    for (row = 0 ; row < k && index[row] < k ; row++ )
+	;
+    if (row == k)
+	return 0 ; /* every data packet arrived, nothing to rebuild */
     m_dec = build_decode_matrix(code, pkt, index);
 
     if (m_dec == NULL)
@@ -893,3 +1247,287 @@ int get_k(void *code0)
 	struct fec_parms * code= (struct fec_parms *)code0;
 	return code->k;
 }
+
+/*
+ * Batch interface. Packet groups are independent and each byte of a
+ * block only depends on the same byte of the other blocks, so a batch
+ * is cut into (group, byte range) tasks spread over a pool of worker
+ * threads. The calling thread takes tasks as well. If another batch
+ * already owns the pool the call just runs on the calling thread.
+ * Workers are started on first use and live as long as the process.
+ */
+#define FEC_THREADS_MAX		16
+#define FEC_STRIPE_MIN		128	/* smaller ranges lose more to task overhead than they gain */
+#define FEC_STRIPE_ALIGN	64	/* keep ranges on separate cache lines */
+
+struct fec_batch {
+    void (*run)(struct fec_batch *b, int task) ;
+    struct fec_parms *code ;
+    gf ***pkt ;		/* block pointers of every group */
+    int **index ;	/* decode only */
+    gf **m_dec ;	/* decode only: NULL for groups with nothing to rebuild */
+    gf ***new_pkt ;	/* decode only: rebuilt blocks */
+    int sz, stripes, stripe_size ;
+    int threads ;	/* including the caller */
+    long tasks ;
+    long next ;		/* next task to hand out */
+    long finished ;	/* guarded by pool_mutex */
+    int active ;	/* workers inside the batch, guarded by pool_mutex */
+} ;
+
+static fec_mutex_t pool_mutex = FEC_MUTEX_INIT ;
+static fec_mutex_t pool_owner = FEC_MUTEX_INIT ;	/* held by the caller whose batch is running */
+static fec_cond_t pool_wake = FEC_COND_INIT ;
+static fec_cond_t pool_done = FEC_COND_INIT ;
+static struct fec_batch *pool_batch ;
+static int pool_workers ;
+static long batch_threads ;	/* 0 picks one per CPU */
+
+int
+fec_get_threads(void)
+{
+    int cpus, threads = (int) fec_atomic_load(&batch_threads) ;
+
+    if (threads > 0)
+	return threads ;
+#if defined(_WIN32)
+    {
+	SYSTEM_INFO info ;
+	GetSystemInfo(&info) ;
+	cpus = (int) info.dwNumberOfProcessors ;
+    }
+#else
+    cpus = (int) sysconf(_SC_NPROCESSORS_ONLN) ;
+#endif
+    return cpus < 1 ? 1 : cpus > FEC_THREADS_MAX ? FEC_THREADS_MAX : cpus ;
+}
+
+void
+fec_set_threads(int threads)
+{
+    fec_atomic_store(&batch_threads, threads < 0 ? 0 : threads > FEC_THREADS_MAX ? FEC_THREADS_MAX : threads) ;
+}
+
+static long
+run_tasks(struct fec_batch *b)
+{
+    long task, done = 0 ;
+
+    while ((task = fec_atomic_inc(&b->next)) < b->tasks) {
+	b->run(b, (int) task) ;
+	done++ ;
+    }
+    return done ;
+}
+
+static FEC_THREAD_PROC
+pool_worker(void *arg)
+{
+    int id = (int) (intptr_t) arg ;	/* 1 and up, the caller is 0 */
+    struct fec_batch *b ;
+    long done ;
+
+    fec_mutex_lock(&pool_mutex) ;
+    for (;;) {
+	while ((b = pool_batch) == NULL || id >= b->threads ||
+	       fec_atomic_load(&b->next) >= b->tasks)
+	    fec_cond_wait(&pool_wake, &pool_mutex) ;
+	b->active++ ;
+	fec_mutex_unlock(&pool_mutex) ;
+
+	done = run_tasks(b) ;
+
+	fec_mutex_lock(&pool_mutex) ;
+	b->active-- ;
+	b->finished += done ;
+	if (b->finished == b->tasks && b->active == 0)
+	    fec_cond_broadcast(&pool_done) ;
+    }
+    return 0 ;
+}
+
+static void
+run_batch(struct fec_batch *b)
+{
+    long done ;
+
+    if (b->threads <= 1 || b->tasks <= 1 || !fec_mutex_trylock(&pool_owner)) {
+	run_tasks(b) ;
+	return ;
+    }
+
+    fec_mutex_lock(&pool_mutex) ;
+    while (pool_workers < b->threads - 1) {
+	void *id = (void *) (intptr_t) (pool_workers + 1) ;
+#if defined(_WIN32)
+	HANDLE thread = CreateThread(NULL, 0, pool_worker, id, 0, NULL) ;
+	if (thread == NULL)
+	    break ;
+	CloseHandle(thread) ;
+#else
+	pthread_t thread ;
+	if (pthread_create(&thread, NULL, pool_worker, id) != 0)
+	    break ;
+	pthread_detach(thread) ;
+#endif
+	pool_workers++ ;
+    }
+    pool_batch = b ;
+    fec_cond_broadcast(&pool_wake) ;
+    fec_mutex_unlock(&pool_mutex) ;
+
+    done = run_tasks(b) ;
+
+    fec_mutex_lock(&pool_mutex) ;
+    b->finished += done ;
+    while (b->finished < b->tasks || b->active > 0)
+	fec_cond_wait(&pool_done, &pool_mutex) ;
+    pool_batch = NULL ;	/* b lives on our stack so no worker may touch it after this */
+    fec_mutex_unlock(&pool_mutex) ;
+    fec_mutex_unlock(&pool_owner) ;
+}
+
+/*
+ * splits each of "groups" blocks of sz elements into a few aligned
+ * byte ranges so every thread gets a couple of tasks
+ */
+static void
+plan_batch(struct fec_batch *b, struct fec_parms *code, int groups, int sz)
+{
+    int stripes ;
+
+    memset(b, 0, sizeof(*b)) ;
+    b->code = code ;
+    b->sz = sz ;
+    b->threads = fec_get_threads() ;
+    stripes = (2 * b->threads + groups - 1) / groups ;
+    b->stripe_size = ((sz + stripes - 1) / stripes + FEC_STRIPE_ALIGN - 1) & ~(FEC_STRIPE_ALIGN - 1) ;
+    if (b->stripe_size < FEC_STRIPE_MIN)
+	b->stripe_size = FEC_STRIPE_MIN ;
+    b->stripes = (sz + b->stripe_size - 1) / b->stripe_size ;
+    b->tasks = (long) groups * b->stripes ;
+}
+
+static void
+encode_task(struct fec_batch *b, int task)
+{
+    int g = task / b->stripes, k = b->code->k ;
+    int off = (task % b->stripes) * b->stripe_size ;
+    int len = b->sz - off < b->stripe_size ? b->sz - off : b->stripe_size ;
+    gf **pkt = b->pkt[g] ;
+    int i, col ;
+
+    for (i = k ; i < b->code->n ; i++) {
+	gf *p = &(b->code->enc_matrix[i*k]) ;
+	bzero(pkt[i] + off, len*sizeof(gf)) ;
+	for (col = 0 ; col < k ; col++)
+	    addmul(pkt[i] + off, pkt[col] + off, p[col], len) ;
+    }
+}
+
+static void
+decode_task(struct fec_batch *b, int task)
+{
+    int g = task / b->stripes, k = b->code->k ;
+    int off = (task % b->stripes) * b->stripe_size ;
+    int len = b->sz - off < b->stripe_size ? b->sz - off : b->stripe_size ;
+    gf **pkt = b->pkt[g], **new_pkt = b->new_pkt[g], *m_dec = b->m_dec[g] ;
+    int *index = b->index[g] ;
+    int row, col ;
+
+    if (m_dec == NULL)
+	return ;
+    for (row = 0 ; row < k ; row++) {
+	if (index[row] >= k) {
+	    bzero(new_pkt[row] + off, len*sizeof(gf)) ;
+	    for (col = 0 ; col < k ; col++)
+		addmul(new_pkt[row] + off, pkt[col] + off, m_dec[row*k + col], len) ;
+	}
+    }
+    /*
+     * the parity blocks we just read from are overwritten only in our
+     * own range, which no other task looks at
+     */
+    for (row = 0 ; row < k ; row++)
+	if (index[row] >= k)
+	    bcopy(new_pkt[row] + off, pkt[row] + off, len*sizeof(gf)) ;
+}
+
+/*
+ * fec_encode_batch fills in the parity blocks k..n-1 of "groups" packet
+ * groups. pkt[g] points to the n blocks of group g.
+ */
+void
+fec_encode_batch(void *code0, void **pkt0[], int groups, int sz)
+{
+    struct fec_batch b ;
+
+    if (GF_BITS > 8)
+	sz /= 2 ;
+    if (groups <= 0 || sz <= 0)
+	return ;
+    plan_batch(&b, (struct fec_parms *)code0, groups, sz) ;
+    b.run = encode_task ;
+    b.pkt = (gf ***)pkt0 ;
+    run_batch(&b) ;
+}
+
+/*
+ * fec_decode_batch is fec_decode on "groups" packet groups at once,
+ * with pkt[g] and index[g] as fec_decode takes them. Groups that fail
+ * to decode are left alone and make the return value nonzero.
+ */
+int
+fec_decode_batch(void *code0, void **pkt0[], int *index[], int groups, int sz)
+{
+    struct fec_parms *code = (struct fec_parms *)code0 ;
+    struct fec_batch b ;
+    int g, row, k = code->k, status = 0 ;
+
+    if (GF_BITS > 8)
+	sz /= 2 ;
+    if (groups <= 0 || sz <= 0)
+	return 0 ;
+    plan_batch(&b, code, groups, sz) ;
+    b.run = decode_task ;
+    b.pkt = (gf ***)pkt0 ;
+    b.index = index ;
+    b.m_dec = (gf **)my_malloc(groups * sizeof(gf *), "batch decode matrices") ;
+    b.new_pkt = (gf ***)my_malloc(groups * sizeof(gf **), "batch new pkt") ;
+
+    for (g = 0 ; g < groups ; g++) {
+	b.m_dec[g] = NULL ;
+	b.new_pkt[g] = NULL ;
+	if (shuffle(b.pkt[g], index[g], k)) {
+	    status = 1 ;
+	    continue ;
+	}
+	for (row = 0 ; row < k && index[g][row] < k ; row++)
+	    ;
+	if (row == k)
+	    continue ; /* every data packet arrived, nothing to rebuild */
+	b.m_dec[g] = build_decode_matrix(code, b.pkt[g], index[g]) ;
+	if (b.m_dec[g] == NULL) {
+	    status = 1 ;
+	    continue ;
+	}
+	b.new_pkt[g] = (gf **)my_malloc(k * sizeof(gf *), "new pkt pointers") ;
+	for (row = 0 ; row < k ; row++)
+	    b.new_pkt[g][row] = index[g][row] >= k ?
+		(gf *)my_malloc(sz * sizeof(gf), "new pkt buffer") : NULL ;
+    }
+
+    run_batch(&b) ;
+
+    for (g = 0 ; g < groups ; g++) {
+	if (b.new_pkt[g] != NULL) {
+	    for (row = 0 ; row < k ; row++)
+		free(b.new_pkt[g][row]) ;
+	    free(b.new_pkt[g]) ;
+	}
+	free(b.m_dec[g]) ;
+    }
+    free(b.new_pkt) ;
+    free(b.m_dec) ;
+    return status ;
+}
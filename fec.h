@@ -52,16 +52,51 @@
 extern "C" {
 #endif
 
+/*
+ * A code returned by fec_new() is never modified afterwards so it can be
+ * shared by any number of threads, and all the functions below may be
+ * called concurrently. The kernel and thread count set further down are
+ * global tuning knobs though: changing them affects every encode and
+ * decode in the process including ones already running. The output is
+ * the same either way, only the speed changes.
+ */
 void fec_free(void *p) ;
 void * fec_new(int k, int n) ;//n>=k
 
-void init_fec() ;  //if you never called this,it will be automatically called in fec_new()
+void init_fec() ;  //if you never called this,it will be automatically called in fec_new(). Thread safe
 void fec_encode(void *code, void *src[], void *dst, int index, int sz) ;
 int fec_decode(void *code, void *pkt[], int index[], int sz) ;
 
 int get_k(void *code);
 int get_n(void *code);
 
+/*
+ * Kernels for the multiply-accumulate loop at the heart of fec_encode()
+ * and fec_decode(). init_fec() selects the fastest one the CPU supports.
+ */
+enum {
+    FEC_KERNEL_TABLE,	/* portable 64KB lookup table */
+    FEC_KERNEL_SSSE3,
+    FEC_KERNEL_AVX2,
+    FEC_KERNEL_NEON,
+    FEC_KERNEL_COUNT
+};
+
+int fec_kernel_supported(int kernel) ;
+const char *fec_kernel_name(int kernel) ;
+int fec_get_kernel(void) ;
+int fec_set_kernel(int kernel) ; //returns nonzero if the kernel isn't supported here
+
+/*
+ * Batch versions of fec_encode/fec_decode for independent packet groups.
+ * pkt[g] (and index[g]) are what fec_encode/fec_decode take for group g.
+ * The work is split by group and byte range over a pool of threads.
+ */
+void fec_encode_batch(void *code, void **pkt[], int groups, int sz) ; //writes blocks k..n-1 of every group
+int fec_decode_batch(void *code, void **pkt[], int *index[], int groups, int sz) ;
+int fec_get_threads(void) ;
+void fec_set_threads(int threads) ; //0 uses one thread per CPU
+
 #ifdef __cplusplus
 }
 #endif
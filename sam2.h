@@ -732,24 +732,110 @@ SAM2_LINKAGE int sam2_client_send(sam2_socket_t sockfd, char *message);
 
 #define RLE8_ENCODE_UPPER_BOUND(N) (3 * ((N+1) / 2) + (N) / 2)
 
+// Zero runs are coded as a 0 byte followed by a little endian uint16 count and non-zero bytes are copied verbatim
+// Most of the time goes into finding where runs end so that is vectorized and the runs themselves are handled with memcpy/memset
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SAM2__RLE8_SIMD_WIDTH 32
+#define SAM2__RLE8_MASK_BITS_PER_BYTE 1
+#define SAM2__RLE8_MASK_ALL 0xFFFFFFFFULL
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SAM2__RLE8_SIMD_WIDTH 16
+#define SAM2__RLE8_MASK_BITS_PER_BYTE 1
+#define SAM2__RLE8_MASK_ALL 0xFFFFULL
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define SAM2__RLE8_SIMD_WIDTH 16
+#define SAM2__RLE8_MASK_BITS_PER_BYTE 4
+#define SAM2__RLE8_MASK_ALL 0xFFFFFFFFFFFFFFFFULL
+#else
+#define SAM2__RLE8_SIMD_WIDTH 0
+#endif
+
+#define SAM2__RLE8_RUN_MAX 0xFFFF
+
+#if SAM2__RLE8_SIMD_WIDTH
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+static inline int sam2__ctz64(uint64_t x) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward64(&index, x);
+    return (int) index;
+#else
+    return __builtin_ctzll(x);
+#endif
+}
+
+// Sets SAM2__RLE8_MASK_BITS_PER_BYTE bits in the result for every zero byte in the next SAM2__RLE8_SIMD_WIDTH bytes
+static inline uint64_t sam2__rle8_zero_mask(const uint8_t *input) {
+#if defined(__AVX2__)
+    __m256i bytes = _mm256_loadu_si256((const __m256i *) input);
+    return (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, _mm256_setzero_si256()));
+#elif SAM2__RLE8_MASK_BITS_PER_BYTE == 1
+    __m128i bytes = _mm_loadu_si128((const __m128i *) input);
+    return (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_setzero_si128()));
+#else
+    // NEON has no movemask so narrow each 0x00/0xFF byte down to a nibble instead
+    uint8x16_t is_zero = vceqq_u8(vld1q_u8(input), vdupq_n_u8(0));
+    return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(is_zero), 4)), 0);
+#endif
+}
+#endif
+
+// Returns how many bytes at the start of input are zero if zero is set or otherwise how many are non-zero
+static int64_t sam2__rle8_run_length(const uint8_t *input, int64_t input_size, int zero) {
+    int64_t i = 0;
+#if SAM2__RLE8_SIMD_WIDTH
+    for (; i + SAM2__RLE8_SIMD_WIDTH <= input_size; i += SAM2__RLE8_SIMD_WIDTH) {
+        uint64_t zero_mask = sam2__rle8_zero_mask(input + i);
+        uint64_t run_end_mask = zero ? ~zero_mask & SAM2__RLE8_MASK_ALL : zero_mask;
+        if (run_end_mask) {
+            return i + sam2__ctz64(run_end_mask) / SAM2__RLE8_MASK_BITS_PER_BYTE;
+        }
+    }
+#endif
+    if (zero) {
+        // Without SIMD we can still skip zeros a word at a time
+        for (; i + 8 <= input_size; i += 8) {
+            uint64_t word;
+            memcpy(&word, input + i, sizeof(word));
+            if (word) break;
+        }
+
+        while (i < input_size && input[i] == 0) i++;
+    } else {
+        while (i < input_size && input[i] != 0) i++;
+    }
+
+    return i;
+}
+
 int64_t rle8_encode_capped(const uint8_t *input, int64_t input_size, uint8_t *output, int64_t output_capacity) {
     int64_t output_size = 0;
-    for (int64_t i = 0; i < input_size; ++i) {
+    for (int64_t i = 0; i < input_size;) {
         if (input[i] == 0) {
-            uint16_t count = 1;
-            while (i + 1 < input_size && input[i + 1] == 0) {
-                count++;
-                i++;
+            int64_t count = sam2__rle8_run_length(input + i, input_size - i, 1);
+            i += count;
+
+            // Runs longer than a uint16 can count are just split
+            for (; count > 0; count -= SAM2__RLE8_RUN_MAX) {
+                if (output_size + 3 > output_capacity) return -1;
+                int64_t run = SAM2_MIN(count, SAM2__RLE8_RUN_MAX);
+                output[output_size++] = 0; // Mark the start of a zero run
+                // Encode count as little endian
+                output[output_size++] = (uint8_t)(run & 0xFF);
+                output[output_size++] = (uint8_t)((run >> 8) & 0xFF);
             }
-
-            if (output_size >= output_capacity-2) return -1;
-            output[output_size++] = 0; // Mark the start of a zero run
-            // Encode count as little endian
-            output[output_size++] = (uint8_t)(count & 0xFF);
-            output[output_size++] = (uint8_t)((count >> 8) & 0xFF);
         } else {
-            if (output_size >= output_capacity) return -1;
-            output[output_size++] = input[i]; // Copy non-zero values directly
+            int64_t count = sam2__rle8_run_length(input + i, input_size - i, 0);
+            if (output_size + count > output_capacity) return -1;
+            memcpy(output + output_size, input + i, count); // Copy non-zero values directly
+            output_size += count;
+            i += count;
         }
     }
     return output_size; // Return the size of the encoded data
@@ -760,50 +846,48 @@ int64_t rle8_encode(const uint8_t *input, int64_t input_size, uint8_t *output) {
     return rle8_encode_capped(input, input_size, output, RLE8_ENCODE_UPPER_BOUND(input_size));
 }
 
-int64_t rle8_decode_extra(const uint8_t* input, int64_t input_size, int64_t *input_consumed, uint8_t* output, int64_t output_capacity) {
+// When strict is set running out of output capacity is an error instead of where decoding stops
+static int64_t sam2__rle8_decode(const uint8_t* input, int64_t input_size, int64_t *input_consumed, uint8_t* output, int64_t output_capacity, int strict) {
     int64_t output_index = 0;
     while (*input_consumed < input_size) {
-        if (output_index >= output_capacity) return output_index;
+        if (output_index >= output_capacity && !strict) return output_index;
         if (input[*input_consumed] == 0) {
-            if (input_size - *input_consumed < 3) return output_index;
+            if (input_size - *input_consumed < 3) return strict ? -1 : output_index; // Truncated run marker
             (*input_consumed)++; // Move past the zero marker
-            uint16_t count = input[*input_consumed] | (input[*input_consumed + 1] << 8); // Decode count as little endian
+            int64_t count = input[*input_consumed] | (input[*input_consumed + 1] << 8); // Decode count as little endian
             (*input_consumed) += 2; // Move past the count bytes
 
-            while (count-- > 0) {
-                if (output_index >= output_capacity) return output_index;
-                output[output_index++] = 0;
+            if (count > output_capacity - output_index) {
+                if (strict) return -1;
+                count = output_capacity - output_index;
             }
+
+            memset(output + output_index, 0, count);
+            output_index += count;
         } else {
-            output[output_index++] = input[(*input_consumed)++];
+            int64_t count = sam2__rle8_run_length(input + *input_consumed, input_size - *input_consumed, 0);
+            if (count > output_capacity - output_index) {
+                if (strict) return -1;
+                count = output_capacity - output_index;
+            }
+
+            memcpy(output + output_index, input + *input_consumed, count);
+            output_index += count;
+            (*input_consumed) += count;
         }
     }
     return output_index; // Return the size of the decoded data
 }
 
-// Decodes the encoded byte stream back into uint8_t values.
-int64_t rle8_decode(const uint8_t* input, int64_t input_size, uint8_t* output, int64_t output_capacity) {
-    int64_t input_consumed = 0;
-    return rle8_decode_extra(input, input_size, &input_consumed, output, output_capacity);
+// Decodes until either the input runs out or the output is full. Useful for streams or if you only want the first few bytes
+int64_t rle8_decode_extra(const uint8_t* input, int64_t input_size, int64_t *input_consumed, uint8_t* output, int64_t output_capacity) {
+    return sam2__rle8_decode(input, input_size, input_consumed, output, output_capacity, 0);
 }
 
-// Calculates the decoded size from the encoded byte stream. @todo Remove you can just roll these checks into the actual decoder
-int64_t rle8_decode_size(const uint8_t* input, int64_t input_size) {
-    int64_t decoded_size = 0;
-    int64_t i = 0;
-    while (i < input_size) {
-        if (input[i] == 0) {
-            i++; // Move past the zero marker
-            uint16_t count = input[i] | (input[i + 1] << 8); // Decode count as little endian
-            i += 2; // Move past the count bytes
-
-            decoded_size += count;
-        } else {
-            decoded_size++;
-            i++;
-        }
-    }
-    return decoded_size;
+// Decodes the encoded byte stream back into uint8_t values. Returns -1 if it decodes to more than output_capacity bytes or ends mid zero run marker
+int64_t rle8_decode(const uint8_t* input, int64_t input_size, uint8_t* output, int64_t output_capacity) {
+    int64_t input_consumed = 0;
+    return sam2__rle8_decode(input, input_size, &input_consumed, output, output_capacity, 1);
 }
 
 #define SAM2__GREY    "\x1B[90m"
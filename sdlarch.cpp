@@ -11,8 +11,7 @@
 #define SAM2_LOG_WRITE(level, file, line, ...) do { if (level >= g_log_level) { sam2__log_write(level, __FILE__, __LINE__, __VA_ARGS__); } } while (0)
 int g_log_level = 1; // Info
 #define MAX_SAMPLE_SIZE 128
-uint64_t rdtsc();
-static uint64_t g_save_cycle_count[MAX_SAMPLE_SIZE] = {0};
+static uint64_t g_save_nsec[MAX_SAMPLE_SIZE] = {0};
 static uint64_t g_frame_cyclic_offset = 0; // Between 0 and g_sample_size-1 @todo replace with a modulo of frame_counter
 static int g_sample_size = MAX_SAMPLE_SIZE/2;
 
@@ -52,6 +51,8 @@ static int g_sample_size = MAX_SAMPLE_SIZE/2;
 #ifdef _WIN32
 #else
 #include <unistd.h> // for sleep
+#include <signal.h>
+#include <sys/wait.h>
 #endif
 
 // Hide OpenGL functions SDL declares with external linkage we just load all of them dynamically to support headless operation
@@ -176,6 +177,7 @@ typedef void (APIENTRYP PFNGLTEXSUBIMAGE2DPROC)(GLenum target, GLint level, GLin
 
 #define DEFINE_GL_PROCEDURES(Type,Func) Type Func = NULL;
 ENUM_GL_PROCEDURES(DEFINE_GL_PROCEDURES);
+static PFNGLBUFFERSTORAGEPROC glBufferStorage = NULL; // Optional. GL 4.4 or ARB_buffer_storage lets us keep the PBOs mapped
 
 static SDL_Window *g_win = NULL;
 static SDL_GLContext g_ctx = NULL;
@@ -189,6 +191,8 @@ static struct retro_audio_callback audio_callback;
 static float g_scale = 3;
 bool running = true;
 
+#define VIDEO_PBO_COUNT 3 // Enough that the driver is done reading a buffer by the time we come back around to it
+
 
 static struct {
     GLuint tex_id;
@@ -207,6 +211,13 @@ static struct {
     GLuint pixtype;
     GLuint bpp;
 
+    // Software frames are copied into a ring of pixel unpack buffers so the texture upload happens asynchronously
+    GLuint pbo_id[VIDEO_PBO_COUNT];
+    void *pbo_map[VIDEO_PBO_COUNT]; // Persistently mapped or NULL if we map every frame
+    GLsync pbo_fence[VIDEO_PBO_COUNT]; // Signaled once the upload out of the buffer is done
+    GLsizeiptr pbo_size;
+    int pbo_index;
+
     struct retro_hw_render_callback hw;
 } g_video  = {0};
 
@@ -433,6 +444,8 @@ static struct FLibretroContext g_libretro_context;
 auto &g_ulnet_session = g_libretro_context.ulnet_session;
 static bool g_headless = 0;
 static int g_netimgui_port = 0;
+static int g_host_room_index = -1; // Index of this worker when running with --rooms, -1 otherwise
+static bool g_host_room_requested = false;
 
 struct keymap {
     unsigned k;
@@ -672,6 +685,17 @@ static void create_window(int width, int height) {
         SAM2_LOG_FATAL("Failed to find all OpenGL entry points");
     }
 
+    // GLX and EGL hand out entry points for functions the context doesn't support so check the version and extensions instead
+    // GLES reports "OpenGL ES x.y" which doesn't parse here and only has the EXT variant of buffer storage anyway
+    int gl_major_version = 0, gl_minor_version = 0;
+    sscanf((const char *) glGetString(GL_VERSION), "%d.%d", &gl_major_version, &gl_minor_version);
+    if (   gl_major_version > 4 || (gl_major_version == 4 && gl_minor_version >= 4)
+        || SDL_GL_ExtensionSupported("GL_ARB_buffer_storage")) {
+        glBufferStorage = (PFNGLBUFFERSTORAGEPROC) SDL_GL_GetProcAddress("glBufferStorage");
+    } else {
+        glBufferStorage = NULL;
+    }
+
     SAM2_LOG_INFO("GL_SHADING_LANGUAGE_VERSION: %s", glGetString(GL_SHADING_LANGUAGE_VERSION));
     SAM2_LOG_INFO("GL_VERSION: %s", glGetString(GL_VERSION));
 
@@ -836,11 +860,13 @@ static int g_sam2_port = SAM2_SERVER_DEFAULT_PORT;
 static sam2_socket_t &g_sam2_socket = g_libretro_context.sam2_socket;
 
 static int g_zstd_compress_level = 0;
-static uint64_t g_zstd_cycle_count[MAX_SAMPLE_SIZE] = {1}; // The 1 is so we don't divide by 0
+static uint64_t g_zstd_nsec[MAX_SAMPLE_SIZE] = {1}; // The 1 is so we don't divide by 0
 static size_t g_zstd_compress_size[MAX_SAMPLE_SIZE] = {0};
-static uint64_t g_reed_solomon_encode_cycle_count[MAX_SAMPLE_SIZE] = {0};
-static uint64_t g_reed_solomon_decode_cycle_count[MAX_SAMPLE_SIZE] = {0};
+static uint64_t g_reed_solomon_encode_nsec[MAX_SAMPLE_SIZE] = {0};
+static uint64_t g_reed_solomon_decode_nsec[MAX_SAMPLE_SIZE] = {0};
 static float g_frame_time_milliseconds[MAX_SAMPLE_SIZE] = {0};
+static int64_t g_broadcast_datagram_count[MAX_SAMPLE_SIZE] = {0}; // Per core tick
+static uint64_t g_broadcast_nsec[MAX_SAMPLE_SIZE] = {0};
 static float g_core_wants_tick_in_milliseconds[MAX_SAMPLE_SIZE] = {0};
 static uint64_t g_main_loop_cyclic_offset = 0;
 static size_t g_serialize_size = 0;
@@ -862,15 +888,34 @@ static int g_lost_packets = 0;
 uint64_t g_remote_savestate_hash = 0x0; // 0x6AEBEEF1EDADD1E5;
 
 #define MAX_SAVE_STATES 64
-static unsigned char g_savebuffer[MAX_SAVE_STATES][20 * 1024 * 1024] = {0};
+// Slots are allocated the first time they're used and grow to fit retro_serialize_size() so we only pay for the states we actually keep
+static unsigned char *g_savebuffer[MAX_SAVE_STATES] = {0};
+static size_t g_savebuffer_size[MAX_SAVE_STATES] = {0};
 
 static int g_save_state_index = 0;
 static int g_save_state_used_for_delta_index_offset = 1;
 
+static unsigned char *savebuffer_slot(int index, size_t size) {
+    if (g_savebuffer_size[index] < size) {
+        unsigned char *buffer = (unsigned char *) realloc(g_savebuffer[index], size);
+        if (!buffer) {
+            SAM2_LOG_FATAL("Failed to allocate %zu bytes for save state", size);
+        }
+
+        memset(buffer + g_savebuffer_size[index], 0, size - g_savebuffer_size[index]);
+        g_savebuffer[index] = buffer;
+        g_savebuffer_size[index] = size;
+    }
+
+    return g_savebuffer[index];
+}
+
 static bool g_is_refreshing_rooms = false;
 
 static int g_volume = 3;
 static bool g_vsync_enabled = true;
+static bool g_video_use_pbo = true;
+static float g_video_upload_milliseconds[MAX_SAMPLE_SIZE] = {0};
 
 static ImVec4 clear_color = ImVec4(0.45f, 0.55f, 0.60f, 1.00f);
 static bool g_connected_to_sam2 = false;
@@ -942,6 +987,247 @@ namespace ImGuiJank {
     }
 }
 
+// The byte-at-a-time RLE8 coder sam2.h used before it was vectorized. Kept around to benchmark and check against
+static int64_t rle8_encode_capped_reference(const uint8_t *input, int64_t input_size, uint8_t *output, int64_t output_capacity) {
+    int64_t output_size = 0;
+    for (int64_t i = 0; i < input_size; ++i) {
+        if (input[i] == 0) {
+            uint16_t count = 1;
+            while (i + 1 < input_size && input[i + 1] == 0) {
+                count++;
+                i++;
+            }
+
+            if (output_size >= output_capacity-2) return -1;
+            output[output_size++] = 0;
+            output[output_size++] = (uint8_t)(count & 0xFF);
+            output[output_size++] = (uint8_t)((count >> 8) & 0xFF);
+        } else {
+            if (output_size >= output_capacity) return -1;
+            output[output_size++] = input[i];
+        }
+    }
+    return output_size;
+}
+
+static int64_t rle8_decode_reference(const uint8_t* input, int64_t input_size, uint8_t* output, int64_t output_capacity) {
+    int64_t output_index = 0;
+    int64_t i = 0;
+    while (i < input_size) {
+        if (output_index >= output_capacity) return output_index;
+        if (input[i] == 0) {
+            if (input_size - i < 3) return output_index;
+            uint16_t count = input[i + 1] | (input[i + 2] << 8);
+            i += 3;
+
+            while (count-- > 0) {
+                if (output_index >= output_capacity) return output_index;
+                output[output_index++] = 0;
+            }
+        } else {
+            output[output_index++] = input[i++];
+        }
+    }
+    return output_index;
+}
+
+// Round trips the ulnet_state_packed_t payload of every input packet in history through both coders since that's what goes on the wire
+static void benchmark_rle8(char *results, size_t results_size) {
+    const int iterations = 64;
+    static ulnet_state_packed_t packed;
+    static uint8_t encoded[RLE8_ENCODE_UPPER_BOUND(sizeof(ulnet_state_packed_t))];
+    static uint8_t encoded_reference[RLE8_ENCODE_UPPER_BOUND(sizeof(ulnet_state_packed_t))];
+    static ulnet_state_packed_t decoded;
+
+    uint64_t encode_nsec = 0, encode_reference_nsec = 0, decode_nsec = 0, decode_reference_nsec = 0;
+    int64_t decoded_bytes = 0, encoded_bytes = 0;
+    int mismatches = 0;
+    for (int i = 0; i < iterations; i++) {
+        for (int p = 0; p < SAM2_PORT_MAX+1; p++) {
+            if (!g_ulnet_session.state_packet_history[p]) continue;
+
+            for (int64_t h = 0; h < g_ulnet_session.state_packet_history_size; h++) {
+                int64_t packet_size = g_ulnet_session.state_packet_history_size_bytes[p][h];
+                if (packet_size == 0) continue;
+
+                ulnet_state_packet_t *packet = (ulnet_state_packet_t *) (g_ulnet_session.state_packet_history[p] + h * ULNET_PACKET_SIZE_BYTES_MAX);
+                int64_t packed_size = rle8_decode(packet->coded_state, packet_size - sizeof(ulnet_state_packet_t), (uint8_t *) &packed, sizeof(packed));
+                if (packed_size <= 0) continue;
+
+                const uint8_t *payload = (const uint8_t *) &packed;
+
+                uint64_t start = ulnet_monotonic_nsec();
+                int64_t encoded_size = rle8_encode(payload, packed_size, encoded);
+                encode_nsec += ulnet_monotonic_nsec() - start;
+
+                start = ulnet_monotonic_nsec();
+                int64_t encoded_reference_size = rle8_encode_capped_reference(payload, packed_size, encoded_reference, sizeof(encoded_reference));
+                encode_reference_nsec += ulnet_monotonic_nsec() - start;
+
+                start = ulnet_monotonic_nsec();
+                int64_t decoded_size = rle8_decode(encoded, encoded_size, (uint8_t *) &decoded, sizeof(decoded));
+                decode_nsec += ulnet_monotonic_nsec() - start;
+
+                mismatches += decoded_size != packed_size || memcmp(&decoded, payload, packed_size) != 0;
+                mismatches += encoded_size != encoded_reference_size || memcmp(encoded, encoded_reference, encoded_size) != 0;
+
+                start = ulnet_monotonic_nsec();
+                rle8_decode_reference(encoded_reference, encoded_reference_size, (uint8_t *) &decoded, sizeof(decoded));
+                decode_reference_nsec += ulnet_monotonic_nsec() - start;
+
+                decoded_bytes += packed_size;
+                encoded_bytes += encoded_size;
+            }
+        }
+    }
+
+    if (decoded_bytes == 0) {
+        snprintf(results, results_size, "No input packets to benchmark yet. Join or host a room first");
+        return;
+    }
+
+    snprintf(results, results_size,
+        "%" PRId64 " bytes coded to %" PRId64 " bytes, %d mismatches\n"
+        "Encode: %.3f ns/byte (reference %.3f)\n"
+        "Decode: %.3f ns/byte (reference %.3f)",
+        decoded_bytes, encoded_bytes, mismatches,
+        (double) encode_nsec / decoded_bytes, (double) encode_reference_nsec / decoded_bytes,
+        (double) decode_nsec / decoded_bytes, (double) decode_reference_nsec / decoded_bytes);
+    SAM2_LOG_INFO("RLE8 benchmark\n%s", results);
+}
+
+// Encodes and decodes a full k=239, n=255 packet group of save state sized blocks with every GF(256) kernel fec.c supports here
+// The kernel and thread count are global so a save state transfer in flight runs on whatever is being measured until we're done
+static void benchmark_reed_solomon(char *results, size_t results_size) {
+    const int k = 239, n = 255, iterations = 8, lost = n - k;
+    const int block_size = ULNET_PACKET_SIZE_BYTES_MAX - sizeof(ulnet_save_state_packet_header_t);
+    static uint8_t blocks[255][ULNET_PACKET_SIZE_BYTES_MAX];
+    static uint8_t reference[255][ULNET_PACKET_SIZE_BYTES_MAX];
+    static uint8_t received[255][ULNET_PACKET_SIZE_BYTES_MAX];
+
+    void *rs_code = fec_new(k, n);
+    int default_kernel = fec_get_kernel();
+
+    void *data[255];
+    for (int i = 0; i < n; i++) {
+        data[i] = blocks[i];
+        for (int j = 0; j < block_size; j++) {
+            blocks[i][j] = (uint8_t) rand();
+        }
+    }
+
+    fec_set_kernel(FEC_KERNEL_TABLE);
+    for (int i = k; i < n; i++) {
+        fec_encode(rs_code, data, reference[i], i, block_size);
+    }
+
+    size_t results_offset = snprintf(results, results_size, "k=%d n=%d %d byte blocks, default kernel %s", k, n, block_size, fec_kernel_name(default_kernel));
+    for (int kernel = 0; kernel < FEC_KERNEL_COUNT && results_offset < results_size; kernel++) {
+        if (fec_set_kernel(kernel)) {
+            continue;
+        }
+
+        uint64_t encode_nsec = 0, decode_nsec = 0;
+        int mismatches = 0;
+        for (int iteration = 0; iteration < iterations; iteration++) {
+            uint64_t start = ulnet_monotonic_nsec();
+            for (int i = k; i < n; i++) {
+                fec_encode(rs_code, data, blocks[i], i, block_size);
+            }
+            encode_nsec += ulnet_monotonic_nsec() - start;
+
+            // Drop the first n-k data blocks and recover them from the parity
+            void *packets[255];
+            int index[255];
+            for (int i = 0; i < k; i++) {
+                index[i] = i < lost ? k + i : i;
+                memcpy(received[i], blocks[index[i]], block_size);
+                packets[i] = received[i];
+            }
+
+            start = ulnet_monotonic_nsec();
+            mismatches += fec_decode(rs_code, packets, index, block_size) != 0;
+            decode_nsec += ulnet_monotonic_nsec() - start;
+
+            for (int i = 0; i < lost; i++) {
+                mismatches += memcmp(packets[i], blocks[i], block_size) != 0;
+            }
+        }
+
+        for (int i = k; i < n; i++) {
+            mismatches += memcmp(blocks[i], reference[i], block_size) != 0;
+        }
+
+        double group_bytes = (double) k * block_size * iterations;
+        results_offset += snprintf(results + results_offset, results_size - results_offset,
+            "\n%-6s encode %.1f MB/s  decode %.1f MB/s  %d mismatches",
+            fec_kernel_name(kernel), group_bytes * 1e3 / encode_nsec, group_bytes * 1e3 / decode_nsec, mismatches);
+    }
+
+    fec_set_kernel(default_kernel);
+
+    // A whole save state worth of packet groups through the batch API, once on one thread and once on the pool
+    {
+        const int groups = FEC_PACKET_GROUPS_MAX;
+        uint8_t *group_blocks = (uint8_t *) malloc((size_t) groups * n * block_size);
+        uint8_t *group_received = (uint8_t *) malloc((size_t) groups * k * block_size);
+        void *group_data[FEC_PACKET_GROUPS_MAX][255], *group_packets[FEC_PACKET_GROUPS_MAX][255];
+        int group_index[FEC_PACKET_GROUPS_MAX][255];
+        void **group_data_ptrs[FEC_PACKET_GROUPS_MAX], **group_packets_ptrs[FEC_PACKET_GROUPS_MAX];
+        int *group_index_ptrs[FEC_PACKET_GROUPS_MAX];
+
+        for (int j = 0; j < groups; j++) {
+            for (int i = 0; i < n; i++) {
+                group_data[j][i] = group_blocks + ((size_t) j * n + i) * block_size;
+            }
+            memcpy(group_blocks + (size_t) j * n * block_size, blocks[0], (size_t) k * block_size);
+            group_data_ptrs[j] = group_data[j];
+        }
+
+        int threads = fec_get_threads();
+        for (int pass = 0; pass < 2 && results_offset < results_size; pass++) {
+            fec_set_threads(pass == 0 ? 1 : 0);
+
+            uint64_t start = ulnet_monotonic_nsec();
+            fec_encode_batch(rs_code, group_data_ptrs, groups, block_size);
+            uint64_t encode_nsec = ulnet_monotonic_nsec() - start;
+
+            for (int j = 0; j < groups; j++) {
+                for (int i = 0; i < k; i++) {
+                    group_index[j][i] = i < lost ? k + i : i;
+                    group_packets[j][i] = group_received + ((size_t) j * k + i) * block_size;
+                    memcpy(group_packets[j][i], group_data[j][group_index[j][i]], block_size);
+                }
+                group_packets_ptrs[j] = group_packets[j];
+                group_index_ptrs[j] = group_index[j];
+            }
+
+            start = ulnet_monotonic_nsec();
+            int mismatches = fec_decode_batch(rs_code, group_packets_ptrs, group_index_ptrs, groups, block_size) != 0;
+            uint64_t decode_nsec = ulnet_monotonic_nsec() - start;
+
+            for (int j = 0; j < groups; j++) {
+                for (int i = 0; i < lost; i++) {
+                    mismatches += memcmp(group_packets[j][i], group_data[j][i], block_size) != 0;
+                }
+            }
+
+            double batch_bytes = (double) groups * k * block_size;
+            results_offset += snprintf(results + results_offset, results_size - results_offset,
+                "\n%d groups on %d thread%s: encode %.1f MB/s  decode %.1f MB/s  %d mismatches",
+                groups, pass == 0 ? 1 : threads, pass == 0 || threads == 1 ? "" : "s",
+                batch_bytes * 1e3 / encode_nsec, batch_bytes * 1e3 / decode_nsec, mismatches);
+        }
+
+        fec_set_threads(0);
+        free(group_received);
+        free(group_blocks);
+    }
+
+    fec_free(rs_code);
+    SAM2_LOG_INFO("Reed-Solomon benchmark\n%s", results);
+}
+
 #include "imgui_internal.h"
 void draw_imgui() {
     static int spinnerIndex = 0;
@@ -992,33 +1278,31 @@ void draw_imgui() {
 
         ImGui::SliderInt("Volume", &g_volume, 0, 100);
 
-        double avg_cycle_count = 0;
+        double avg_save_nsec = 0;
         double avg_zstd_compress_size = 0;
         double max_compress_size = 0;
-        double avg_zstd_cycle_count = 0;
-        double max_reed_solomon_decode_cycle_count = 0;
+        double avg_zstd_nsec = 0;
+        double max_reed_solomon_decode_nsec = 0;
 
         for (int i = 0; i < g_sample_size; i++) {
-            avg_cycle_count += g_save_cycle_count[i];
+            avg_save_nsec += g_save_nsec[i];
             avg_zstd_compress_size += g_zstd_compress_size[i];
-            avg_zstd_cycle_count += g_zstd_cycle_count[i];
+            avg_zstd_nsec += g_zstd_nsec[i];
             if (g_zstd_compress_size[i] > max_compress_size) {
                 max_compress_size = g_zstd_compress_size[i];
             }
-            if (g_reed_solomon_decode_cycle_count[i] > max_reed_solomon_decode_cycle_count) {
-                max_reed_solomon_decode_cycle_count = g_reed_solomon_decode_cycle_count[i];
+            if (g_reed_solomon_decode_nsec[i] > max_reed_solomon_decode_nsec) {
+                max_reed_solomon_decode_nsec = g_reed_solomon_decode_nsec[i];
             }
         }
-        avg_cycle_count        /= g_sample_size;
+        avg_save_nsec          /= g_sample_size;
         avg_zstd_compress_size /= g_sample_size;
-        avg_zstd_cycle_count   /= g_sample_size;
+        avg_zstd_nsec          /= g_sample_size;
 
         strcpy(unit, "bits");
         double display_count = format_unit_count(8 * g_retro.retro_serialize_size(), unit);
         ImGui::Text("retro_serialize_size: %g %s", display_count, unit);
-        strcpy(unit, "cycles");
-        display_count = format_unit_count(avg_cycle_count, unit);
-        ImGui::Text("retro_serialize average cycle count: %.2f %s", display_count, unit);
+        ImGui::Text("retro_serialize average time: %.3f ms", avg_save_nsec / 1e6);
         ImGui::Checkbox("Compress serialized data with zstd", &g_do_zstd_compress);
         if (g_do_zstd_compress) {
             const char *algorithm_name = g_use_rle ? "rle" : "zstd";
@@ -1045,8 +1329,8 @@ void draw_imgui() {
             display_count = format_unit_count(8 * max_compress_size, unit);
             ImGui::Text("%s compression max size: %.2f %s", algorithm_name, display_count, unit);
 
-            strcpy(unit, "bytes/cycle");
-            display_count = format_unit_count(g_serialize_size / avg_zstd_cycle_count, unit);
+            strcpy(unit, "bytes/second");
+            display_count = format_unit_count(g_serialize_size / (avg_zstd_nsec / 1e9), unit);
             ImGui::Text("%s compression average speed: %.2f %s", algorithm_name, display_count, unit);
 
             ImGui::Text("Remote Savestate hash: %" PRIx64 "", g_remote_savestate_hash);
@@ -1060,7 +1344,7 @@ void draw_imgui() {
 
         { // Show a graph of one of the data sets
             // Add a combo box for buffer selection
-            static const char* items[] = {"save_cycle_count", "cycle_count", "compress_size"};
+            static const char* items[] = {"save_nsec", "zstd_nsec", "compress_size"};
             static int current_item = 0;  // default selection
             ImGui::Combo("Buffers", &current_item, items, IM_ARRAYSIZE(items));
 
@@ -1070,11 +1354,11 @@ void draw_imgui() {
             // Based on the selection, copy data to the temp array and draw the graph for the corresponding buffer.
             if (current_item == 0) {
                 for (int i = 0; i < g_sample_size; ++i) {
-                    temp[i] = static_cast<float>(g_save_cycle_count[(i+g_frame_cyclic_offset)%g_sample_size]);
+                    temp[i] = static_cast<float>(g_save_nsec[(i+g_frame_cyclic_offset)%g_sample_size]);
                 }
             } else if (current_item == 1) {
                 for (int i = 0; i < g_sample_size; ++i) {
-                    temp[i] = static_cast<float>(g_zstd_cycle_count[(i+g_frame_cyclic_offset)%g_sample_size]);
+                    temp[i] = static_cast<float>(g_zstd_nsec[(i+g_frame_cyclic_offset)%g_sample_size]);
                 }
             } else if (current_item == 2) {
                 for (int i = 0; i < g_sample_size; ++i) {
@@ -1216,6 +1500,28 @@ void draw_imgui() {
                     sam2_client_send(g_libretro_context.sam2_socket, (char *) &message);
                 }
             }
+
+            static char rle8_benchmark_results[256] = "";
+            if (ImGui::Button("Benchmark RLE8 on input packets")) {
+                benchmark_rle8(rle8_benchmark_results, sizeof(rle8_benchmark_results));
+            }
+
+            if (ImGui::IsItemHovered()) {
+                ImGui::SetTooltip("Compares sam2.h's RLE8 coder against a byte-at-a-time reference on the payloads of every input packet in history");
+            }
+
+            ImGui::TextUnformatted(rle8_benchmark_results);
+
+            static char reed_solomon_benchmark_results[768] = "";
+            if (ImGui::Button("Benchmark Reed-Solomon kernels")) {
+                benchmark_reed_solomon(reed_solomon_benchmark_results, sizeof(reed_solomon_benchmark_results));
+            }
+
+            if (ImGui::IsItemHovered()) {
+                ImGui::SetTooltip("Times fec_encode and fec_decode on a full k=239, n=255 packet group with every GF(256) multiply kernel this CPU supports, then a batch of packet groups on one thread and on fec.c's thread pool");
+            }
+
+            ImGui::TextUnformatted(reed_solomon_benchmark_results);
         }
 
         const char* levelNames[] = {"Debug", "Info", "Warn", "Error", "Fatal"};
@@ -1359,10 +1665,10 @@ void draw_imgui() {
                     }
                 }
 
-                char buffer_depth[ULNET_DELAY_BUFFER_SIZE] = {0};
+                char buffer_depth[ULNET_DELAY_BUFFER_SIZE_MAX] = {0};
 
                 int64_t peer_num_frames_ahead = g_ulnet_session.state[p].frame - g_ulnet_session.frame_counter;
-                for (int f = 0; f < sizeof(buffer_depth)-1; f++) {
+                for (int f = 0; f < SAM2_MIN((int64_t) sizeof(buffer_depth), g_ulnet_session.delay_buffer_size)-1; f++) {
                     buffer_depth[f] = f < peer_num_frames_ahead ? 'X' : 'O';
                 }
 
@@ -1371,7 +1677,12 @@ void draw_imgui() {
             }
         }
 
-        if (g_ulnet_session.room_we_are_in.peer_ids[SAM2_AUTHORITY_INDEX] == g_ulnet_session.our_peer_id) {
+        if (g_ulnet_session.relay_parent_peer_id) {
+            ImGui::Text("Relaying input through %016" PRIx64, g_ulnet_session.relay_parent_peer_id);
+        }
+
+        if (   g_ulnet_session.room_we_are_in.peer_ids[SAM2_AUTHORITY_INDEX] == g_ulnet_session.our_peer_id
+            || g_ulnet_session.spectator_count > 0 /* We're relaying to other spectators */) {
 
             ImGui::BeginChild("SpectatorsTableWindow", 
                 ImVec2(
@@ -1429,7 +1740,7 @@ void draw_imgui() {
                 if (   ImGui::Button("Exit")
                     && sam2_get_port_of_peer(&g_ulnet_session.room_we_are_in, g_ulnet_session.our_peer_id) == -1 /* Can't disconnect before leaving the room */) {
                     sam2_signal_message_t response = { SAM2_SIGX_HEADER };
-                    response.peer_id = g_ulnet_session.room_we_are_in.peer_ids[SAM2_AUTHORITY_INDEX];
+                    response.peer_id = g_ulnet_session.relay_parent_peer_id ? g_ulnet_session.relay_parent_peer_id : g_ulnet_session.room_we_are_in.peer_ids[SAM2_AUTHORITY_INDEX];
                     g_libretro_context.SAM2Send((char *) &response);
                     ulnet_disconnect_peer(&g_ulnet_session, SAM2_AUTHORITY_INDEX);
                     memcpy(&g_ulnet_session.room_we_are_in, &g_new_room_set_through_gui, sizeof(sam2_room_t));
@@ -1628,11 +1939,51 @@ finished_drawing_sam2_interface:
         }
 
         {
+            if (g_ulnet_session.room_we_are_in.flags & SAM2_FLAG_ROOM_IS_NETWORK_HOSTED) {
+                ImGui::Text("Delay Buffer Size: %" PRId64, g_ulnet_session.delay_buffer_size);
+            } else {
+                int64_t min_delay_buffer_size = 2;
+                int64_t max_delay_buffer_size = ULNET_DELAY_BUFFER_SIZE_MAX;
+                if (ImGui::SliderScalar("Delay Buffer Size", ImGuiDataType_S64, &g_ulnet_session.delay_buffer_size, &min_delay_buffer_size, &max_delay_buffer_size, "%lld", ImGuiSliderFlags_None)) {
+                    g_ulnet_session.delay_frames = SAM2_MIN(g_ulnet_session.delay_frames, ULNET_DELAY_FRAMES_MAX(g_ulnet_session.delay_buffer_size));
+                }
+
+                if (ImGui::IsItemHovered()) {
+                    ImGui::SetTooltip("Frames of input that can be in flight. Larger values allow more buffered frames on high latency connections. Fixed once the room is made");
+                }
+            }
+
             int64_t min_delay_frames = 0;
-            int64_t max_delay_frames = ULNET_DELAY_BUFFER_SIZE/2-1;
+            int64_t max_delay_frames = ULNET_DELAY_FRAMES_MAX(g_ulnet_session.delay_buffer_size);
             if (ImGui::SliderScalar("Network Buffered Frames", ImGuiDataType_S64, &g_ulnet_session.delay_frames, &min_delay_frames, &max_delay_frames, "%lld", ImGuiSliderFlags_None)) {
                 strcpy(g_core_option_for_next_frame.key, "netplay_delay_frames");
-                sprintf(g_core_option_for_next_frame.value, "%" PRIx64, g_ulnet_session.delay_frames);
+                sprintf(g_core_option_for_next_frame.value, "%" PRId64, g_ulnet_session.delay_frames);
+            }
+
+            if (ulnet_is_authority(&g_ulnet_session)) {
+                int64_t min_rollback_frames = 0;
+                int64_t max_rollback_frames = ULNET_ROLLBACK_FRAMES_MAX(g_ulnet_session.delay_buffer_size);
+                if (ImGui::SliderScalar("Rollback Frames", ImGuiDataType_S64, &g_ulnet_session.rollback_frames, &min_rollback_frames, &max_rollback_frames, "%lld", ImGuiSliderFlags_None)) {
+                    strcpy(g_core_option_for_next_frame.key, "netplay_rollback_frames");
+                    sprintf(g_core_option_for_next_frame.value, "%" PRId64, g_ulnet_session.rollback_frames);
+                }
+            } else {
+                ImGui::Text("Rollback Frames: %" PRId64, g_ulnet_session.rollback_frames);
+            }
+
+            if (ImGui::IsItemHovered()) {
+                ImGui::SetTooltip("Frames we tick ahead of remote input by predicting it. Buffered frames count against this");
+            }
+
+            int64_t save_state_transfer_kbps = (g_ulnet_session.save_state_transfer_bitrate ? g_ulnet_session.save_state_transfer_bitrate : ULNET_SAVESTATE_TRANSFER_BITRATE_DEFAULT) / 1000;
+            int64_t min_save_state_transfer_kbps = ULNET_SAVESTATE_TRANSFER_BITRATE_MIN / 1000;
+            int64_t max_save_state_transfer_kbps = 100 * 1000;
+            if (ImGui::SliderScalar("Save State Upload (kbit/s)", ImGuiDataType_S64, &save_state_transfer_kbps, &min_save_state_transfer_kbps, &max_save_state_transfer_kbps, "%lld", ImGuiSliderFlags_Logarithmic)) {
+                g_ulnet_session.save_state_transfer_bitrate = save_state_transfer_kbps * 1000;
+            }
+
+            if (ImGui::IsItemHovered()) {
+                ImGui::SetTooltip("Fastest we send save states to peers joining the room. We slow down on our own if they start losing packets");
             }
         }
 
@@ -1669,11 +2020,17 @@ finished_drawing_sam2_interface:
         } else {
             ImGui::Text("Core ticks: %" PRId64, g_ulnet_session.frame_counter);
         }
+        ImGui::Checkbox("Upload video through PBOs", &g_video_use_pbo);
+        if (ImGui::IsItemHovered()) {
+            ImGui::SetTooltip("Copies software rendered frames into a ring of pixel buffer objects so the texture upload doesn't stall us on the driver");
+        }
+
         ImGui::Text("Core tick time (ms)");
 
         float *frame_time_dataset[] = {
             g_frame_time_milliseconds,
             g_core_wants_tick_in_milliseconds,
+            g_video_upload_milliseconds,
         };
 
         for (int datasetIndex = 0; datasetIndex < SAM2_ARRAY_LENGTH(frame_time_dataset); datasetIndex++) {
@@ -1684,6 +2041,7 @@ finished_drawing_sam2_interface:
             uint64_t cyclic_offset[] = {
                 g_frame_cyclic_offset,
                 g_main_loop_cyclic_offset,
+                g_frame_cyclic_offset,
             };
 
             maxVal = -FLT_MAX;
@@ -1702,16 +2060,18 @@ finished_drawing_sam2_interface:
             if (datasetIndex == 0) {
                 ImGui::Text("Max: %.3f ms  Min: %.3f ms", maxVal, minVal);
                 ImGui::Text("Average: %.3f ms  Ideal: %.3f ms", avgVal, 1000.0f / g_av.timing.fps);
+            } else if (datasetIndex == 2) {
+                ImGui::Text("Video upload average: %.3f ms  Max: %.3f ms", avgVal, maxVal);
             }
 
-            // Set the axis limits before beginning the plot
+            // Set the axis limits before beginning the plot. Uploads are usually well under a millisecond
             ImPlot::SetNextAxisLimits(ImAxis_X1, 0, g_sample_size, ImGuiCond_Always);
-            ImPlot::SetNextAxisLimits(ImAxis_Y1, 0.0f, SAM2_MAX(50.0f, maxVal), ImGuiCond_Always);
+            ImPlot::SetNextAxisLimits(ImAxis_Y1, 0.0f, datasetIndex == 2 ? SAM2_MAX(1.0f, maxVal) : SAM2_MAX(50.0f, maxVal), ImGuiCond_Always);
 
-            const char* plotTitles[] = {"Frame Time Plot", "Core Wants Tick Plot"};
+            const char* plotTitles[] = {"Frame Time Plot", "Core Wants Tick Plot", "Video Upload Plot"};
             if (ImPlot::BeginPlot(plotTitles[datasetIndex], plotSize)) {
                 // Plot the histogram
-                const char* barTitles[] = {"Frame Times", "Time until core wants to tick"};
+                const char* barTitles[] = {"Frame Times", "Time until core wants to tick", "Video upload time"};
                 ImPlot::PlotBars(barTitles[datasetIndex], temp, g_sample_size, 0.67f, -0.5f);
 
                 // Plot max, min, and average lines without changing their colors
@@ -1725,6 +2085,17 @@ finished_drawing_sam2_interface:
         }
 
         ImGui::Text("Application average %.3f ms/frame (%.1f FPS)", 1000.0f / io.Framerate, io.Framerate);
+
+        double avg_broadcast_datagram_count = 0;
+        double avg_broadcast_nsec = 0;
+        for (int i = 0; i < g_sample_size; i++) {
+            avg_broadcast_datagram_count += g_broadcast_datagram_count[i];
+            avg_broadcast_nsec += g_broadcast_nsec[i];
+        }
+        avg_broadcast_datagram_count /= g_sample_size;
+        avg_broadcast_nsec /= g_sample_size;
+
+        ImGui::Text("Broadcast average per tick: %.1f datagrams %.2f us", avg_broadcast_datagram_count, avg_broadcast_nsec / 1e3);
         ImGui::End();
     }
 
@@ -1804,6 +2175,90 @@ static void draw_core_frame() {
     glUseProgram(0);
 }
 
+static void video_pbo_deinit() {
+    for (int i = 0; i < VIDEO_PBO_COUNT; i++) {
+        if (g_video.pbo_fence[i]) {
+            glDeleteSync(g_video.pbo_fence[i]);
+        }
+
+        if (g_video.pbo_map[i]) {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, g_video.pbo_id[i]);
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        }
+    }
+
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    if (g_video.pbo_id[0]) {
+        glDeleteBuffers(VIDEO_PBO_COUNT, g_video.pbo_id);
+    }
+
+    memset(g_video.pbo_id, 0, sizeof(g_video.pbo_id));
+    memset(g_video.pbo_map, 0, sizeof(g_video.pbo_map));
+    memset(g_video.pbo_fence, 0, sizeof(g_video.pbo_fence));
+    g_video.pbo_size = 0;
+    g_video.pbo_index = 0;
+}
+
+static void video_pbo_init(GLsizeiptr size) {
+    video_pbo_deinit();
+
+    glGenBuffers(VIDEO_PBO_COUNT, g_video.pbo_id);
+    for (int i = 0; i < VIDEO_PBO_COUNT; i++) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, g_video.pbo_id[i]);
+        if (glBufferStorage) {
+            GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            glBufferStorage(GL_PIXEL_UNPACK_BUFFER, size, NULL, flags);
+            g_video.pbo_map[i] = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, flags);
+        } else {
+            glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+        }
+    }
+
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    g_video.pbo_size = size;
+    SAM2_LOG_INFO("Uploading video through %d %s PBOs of %d bytes", VIDEO_PBO_COUNT, glBufferStorage ? "persistently mapped" : "mapped per frame", (int) size);
+}
+
+// Copies the frame into the next buffer in the ring and lets the driver upload it to the texture whenever it gets to it
+static void video_upload_through_pbo(const void *data, unsigned width, unsigned height) {
+    GLsizeiptr size = (GLsizeiptr) g_video.pitch * (height - 1) + width * g_video.bpp; // The last row doesn't have to be padded out to the pitch
+    if (g_video.pbo_size < size) {
+        video_pbo_init(size);
+    }
+
+    int i = g_video.pbo_index;
+    g_video.pbo_index = (g_video.pbo_index + 1) % VIDEO_PBO_COUNT;
+
+    if (g_video.pbo_fence[i]) {
+        glClientWaitSync(g_video.pbo_fence[i], GL_SYNC_FLUSH_COMMANDS_BIT, UINT64_MAX); // Normally signaled long ago
+        glDeleteSync(g_video.pbo_fence[i]);
+        g_video.pbo_fence[i] = NULL;
+    }
+
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, g_video.pbo_id[i]);
+    void *pbo = g_video.pbo_map[i];
+    if (!pbo) {
+        pbo = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+    }
+
+    if (pbo) {
+        memcpy(pbo, data, size);
+        if (!g_video.pbo_map[i]) {
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        }
+
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height,
+                        g_video.pixtype, g_video.pixfmt, (const void *) 0); // Offset into the bound buffer
+        g_video.pbo_fence[i] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    } else {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height,
+                        g_video.pixtype, g_video.pixfmt, data);
+    }
+
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
 static void video_refresh(const void *data, unsigned width, unsigned height, unsigned pitch) {
     if (g_video.clip_w != width || g_video.clip_h != height)
     {
@@ -1820,13 +2275,21 @@ static void video_refresh(const void *data, unsigned width, unsigned height, uns
         g_video.pitch = pitch;
 
     if (data && data != RETRO_HW_FRAME_BUFFER_VALID) {
+        uint64_t start = ulnet_monotonic_nsec();
         glPixelStorei(GL_UNPACK_ROW_LENGTH, g_video.pitch / g_video.bpp);
-        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height,
-                        g_video.pixtype, g_video.pixfmt, data);
+        if (g_video_use_pbo) {
+            video_upload_through_pbo(data, width, height);
+        } else {
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height,
+                            g_video.pixtype, g_video.pixfmt, data);
+        }
+        g_video_upload_milliseconds[g_frame_cyclic_offset] = (ulnet_monotonic_nsec() - start) / 1e6f;
     }
 }
 
 static void video_deinit() {
+    video_pbo_deinit();
+
     if (g_video.fbo_id)
         glDeleteFramebuffers(1, &g_video.fbo_id);
 
@@ -1881,7 +2344,25 @@ static void audio_deinit() {
     SDL_DestroyAudioStream(g_pcm);
 }
 
+// What we answer RETRO_ENVIRONMENT_GET_AUDIO_VIDEO_ENABLE with. For many cores rendering and synthesizing audio is most of
+// retro_run so we let them skip it for frames nobody will see or hear:
+// - Headless there's no window or audio device
+// - Resimulated frames after a rollback were already played once and only the last tick's frame gets drawn
+// - Frames a spectator runs back to back to catch up are never presented
+static int core_audio_video_enable() {
+    if (   g_headless
+        || g_ulnet_session.flags & (ULNET_SESSION_FLAG_RESIMULATING | ULNET_SESSION_FLAG_CATCHING_UP)) {
+        return 0;
+    }
+
+    return 1 << 0 /* Video */ | 1 << 1 /* Audio */;
+}
+
 static size_t audio_write(const int16_t *buf, unsigned frames) {
+    if (!(core_audio_video_enable() & 1 << 1)) {
+        return frames; // Not every core checks whether audio is enabled
+    }
+
     int16_t scaled_buf[4096];
     for (unsigned i = 0; i < frames * 2; i++) {
         scaled_buf[i] = (buf[i] * g_volume) / 100;
@@ -1923,7 +2404,6 @@ static uintptr_t core_get_current_framebuffer() {
     return g_video.fbo_id;
 }
 
-int64_t get_unix_time_microseconds();
 /**
  * cpu_features_get_time_usec:
  *
@@ -1932,7 +2412,7 @@ int64_t get_unix_time_microseconds();
  * Returns: time in microseconds.
  **/
 retro_time_t cpu_features_get_time_usec(void) {
-    return get_unix_time_microseconds();
+    return ulnet_monotonic_usec();
 }
 
 /**
@@ -1971,13 +2451,13 @@ static uint64_t core_get_cpu_features() {
 }
 
 /**
- * A simple counter. Usually nanoseconds, but can also be CPU cycles.
+ * A simple counter. Nanoseconds on the same clock ulnet uses.
  *
  * @see retro_perf_get_counter_t
  * @return retro_perf_tick_t The current value of the high resolution counter.
  */
 static retro_perf_tick_t core_get_perf_counter() {
-    return (retro_perf_tick_t)rdtsc();
+    return (retro_perf_tick_t)ulnet_monotonic_nsec();
 }
 
 /**
@@ -2164,7 +2644,7 @@ static bool core_environment(unsigned cmd, void *data) {
     }
     case RETRO_ENVIRONMENT_GET_AUDIO_VIDEO_ENABLE: {
         int *value = (int*)data;
-        *value = 1 << 0 | 1 << 1;
+        *value = core_audio_video_enable();
         return true;
     }
     case RETRO_ENVIRONMENT_SET_SERIALIZATION_QUIRKS: {
@@ -2183,6 +2663,7 @@ static bool core_environment(unsigned cmd, void *data) {
 
 static void core_video_refresh(const void *data, unsigned width, unsigned height, size_t pitch) {
     if (!g_win) return;
+    if (!(core_audio_video_enable() & 1 << 0)) return; // Not every core checks whether video is enabled
     video_refresh(data, width, height, pitch);
 }
 
@@ -2344,24 +2825,6 @@ void receive_juice_log(juice_log_level_t level, const char *message) {
     assert(level < JUICE_LOG_LEVEL_ERROR);
 }
 
-uint64_t rdtsc() {
-#if defined(__aarch64__) || defined(__arm__)
-    return 1000 * get_unix_time_microseconds();
-#else
-#if defined(_MSC_VER)   /* MSVC compiler */
-    return __rdtsc();
-#elif defined(__GNUC__) /* GCC compiler */
-    unsigned int lo, hi;
-    __asm__ __volatile__ (
-      "rdtsc" : "=a" (lo), "=d" (hi)  
-    );
-    return ((uint64_t)hi << 32) | lo;
-#else
-#error "Unsupported compiler"
-#endif
-#endif
-}
-
 void rle_encode32(void *input_typeless, size_t inputSize, void *output_typeless, size_t *outputSize) {
     size_t writeIndex = 0;
     size_t readIndex = 0;
@@ -2446,18 +2909,27 @@ extern "C" {
 
 // I pulled this out of main because it kind of clutters the logic and to get back some indentation
 void tick_compression_investigation(char *save_state, size_t save_state_size, char *rom_data, size_t rom_size) {
-    uint64_t start = rdtsc();
-    unsigned char *buffer = g_savebuffer[g_save_state_index];
-    static unsigned char g_savebuffer_delta[sizeof(g_savebuffer[0])];
+    uint64_t start = ulnet_monotonic_nsec();
+    unsigned char *buffer = (unsigned char *) save_state;
+    static unsigned char *g_savebuffer_delta = NULL;
+    static unsigned char *savebuffer_compressed = NULL;
+    static size_t savebuffer_compressed_size = 0;
+    if (savebuffer_compressed_size < 2 * save_state_size) {
+        // Double the savestate size just cause degenerate run length encoding could make it about 1.5x I think
+        savebuffer_compressed_size = SAM2_MAX(2 * save_state_size, ZSTD_compressBound(save_state_size));
+        savebuffer_compressed = (unsigned char *) realloc(savebuffer_compressed, savebuffer_compressed_size);
+        g_savebuffer_delta = (unsigned char *) realloc(g_savebuffer_delta, save_state_size);
+    }
+
     if (g_do_zstd_delta_compress) {
         buffer = g_savebuffer_delta;
+        int delta_index = (g_save_state_index - g_save_state_used_for_delta_index_offset + MAX_SAVE_STATES) % MAX_SAVE_STATES;
+        unsigned char *delta_base = savebuffer_slot(delta_index, save_state_size);
         for (int i = 0; i < g_serialize_size; i++) {
-            int delta_index = (g_save_state_index - g_save_state_used_for_delta_index_offset + MAX_SAVE_STATES) % MAX_SAVE_STATES;
-            g_savebuffer_delta[i] = g_savebuffer[delta_index][i] ^ g_savebuffer[g_save_state_index][i];
+            g_savebuffer_delta[i] = delta_base[i] ^ (unsigned char) save_state[i];
         } 
     }
 
-    static unsigned char savebuffer_compressed[2 * sizeof(g_savebuffer[0])]; // Double the savestate size just cause degenerate run length encoding could make it about 1.5x I think
     if (g_use_rle) {
         // If we're 4 byte aligned use the 4-byte wordsize rle that gives us the highest gains in 32-bit consoles (where we need it the most)
         if (g_serialize_size % 4 == 0) {
@@ -2509,13 +2981,13 @@ void tick_compression_investigation(char *save_state, size_t save_state_size, ch
 
             if (cdict) {
                 g_zstd_compress_size[g_frame_cyclic_offset] = ZSTD_compress_usingCDict(cctx, 
-                                                                                       savebuffer_compressed, COMPRESSED_SAVE_STATE_BOUND_BYTES,
+                                                                                       savebuffer_compressed, savebuffer_compressed_size,
                                                                                        buffer, g_serialize_size, 
                                                                                        cdict);
             }
         } else {
             g_zstd_compress_size[g_frame_cyclic_offset] = ZSTD_compress(savebuffer_compressed,
-                                                                        COMPRESSED_SAVE_STATE_BOUND_BYTES,
+                                                                        savebuffer_compressed_size,
                                                                         buffer, g_serialize_size, g_zstd_compress_level);
         }
 
@@ -2526,7 +2998,7 @@ void tick_compression_investigation(char *save_state, size_t save_state_size, ch
         g_zstd_compress_size[g_frame_cyclic_offset] = 0;
     }
 
-    g_zstd_cycle_count[g_frame_cyclic_offset] = rdtsc() - start;
+    g_zstd_nsec[g_frame_cyclic_offset] = ulnet_monotonic_nsec() - start;
 
     // I'm trying to compress the save state data by finding matching blocks that are in the ROM.
     // This doesn't seem to work. Here are my theories:
@@ -2622,16 +3094,120 @@ void tick_compression_investigation(char *save_state, size_t save_state_size, ch
 #endif
 }
 
+#ifndef _WIN32
+static volatile sig_atomic_t g_host_rooms_stopping = 0;
+
+static void host_rooms_signal_handler(int signum) {
+    g_host_rooms_stopping = signum;
+}
+
+static void host_rooms_close_inherited_fd(uv_handle_t *handle, void *arg) {
+    uv_os_fd_t fd;
+    if (uv_fileno(handle, &fd) == 0) close(fd);
+}
+
+// Workers only need a copy of the parent's signaling server to tear down. The sockets have to be closed by hand because
+// uv_close would deregister them from the epoll instance the parent shares with us
+static void host_rooms_close_inherited_server(void) {
+    if (!g_sam2_server) return;
+
+    uv_walk(&g_sam2_server->loop, host_rooms_close_inherited_fd, NULL); // Listen socket and accepted clients
+    close(uv_backend_fd(&g_sam2_server->loop));
+    free(g_sam2_server);
+    g_sam2_server = NULL;
+}
+
+// Libretro cores keep their state in globals so they can't be instanced twice in one address space, and neither can
+// everything in here hanging off g_libretro_context. So each room gets its own worker process running the normal
+// headless main loop while the parent hosts the signaling server and respawns workers that die
+// Returns the index of the room in the worker, the parent never returns
+static int host_rooms_fork_workers(int room_count) {
+    pid_t *worker_pid = (pid_t *) calloc(room_count, sizeof(pid_t));
+    retro_time_t *worker_spawned_at_usec = (retro_time_t *) calloc(room_count, sizeof(retro_time_t));
+
+    struct sigaction action = {0};
+    action.sa_handler = host_rooms_signal_handler;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    while (!g_host_rooms_stopping) {
+        retro_time_t now = cpu_features_get_time_usec();
+        for (int i = 0; i < room_count; i++) {
+            // Back off on workers that die right away e.g. the core can't load so we don't fork bomb ourselves
+            if (worker_pid[i] || now - worker_spawned_at_usec[i] < 1000000) continue;
+
+            pid_t pid = fork();
+            if (pid < 0) {
+                SAM2_LOG_ERROR("Failed to fork worker for room %d", i);
+            } else if (pid == 0) {
+                signal(SIGINT, SIG_DFL);
+                signal(SIGTERM, SIG_DFL);
+                free(worker_pid);
+                free(worker_spawned_at_usec);
+                host_rooms_close_inherited_server(); // The server and its event loop belong to the parent
+                return i;
+            } else {
+                SAM2_LOG_INFO("Spawned worker %d for room %d", (int) pid, i);
+                worker_pid[i] = pid;
+                worker_spawned_at_usec[i] = now;
+            }
+        }
+
+        if (g_sam2_server) {
+            for (int i = 0; i < 128; i++) {
+                if (uv_run(&g_sam2_server->loop, UV_RUN_NOWAIT) == 0) break;
+            }
+        }
+
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (int i = 0; i < room_count; i++) {
+                if (worker_pid[i] != pid) continue;
+                if (WIFSIGNALED(status)) {
+                    SAM2_LOG_WARN("Worker for room %d was killed by signal %d respawning", i, WTERMSIG(status));
+                } else {
+                    SAM2_LOG_WARN("Worker for room %d exited with status %d respawning", i, WEXITSTATUS(status));
+                }
+                worker_pid[i] = 0;
+            }
+        }
+
+        usleep(1000);
+    }
+
+    SAM2_LOG_INFO("Received signal %d stopping %d workers", (int) g_host_rooms_stopping, room_count);
+    for (int i = 0; i < room_count; i++) {
+        if (worker_pid[i]) kill(worker_pid[i], SIGTERM);
+    }
+    for (int i = 0; i < room_count; i++) {
+        if (worker_pid[i]) waitpid(worker_pid[i], NULL, 0);
+    }
+
+    free(worker_pid);
+    free(worker_spawned_at_usec);
+    exit(0);
+}
+#endif
+
 int main(int argc, char *argv[]) {
     g_argc = argc;
     g_argv = argv;
 
     bool no_netimgui = false;
+    int host_room_count = 0;
     for (int i = 2; i < argc; i++) {
         if (strcmp("--headless", argv[i]) == 0) {
             g_headless = true;
         } else if (strcmp("--no-netimgui", argv[i]) == 0) {
             no_netimgui = true;
+        } else if (strcmp("--rooms", argv[i]) == 0 && i + 1 < argc) {
+            host_room_count = atoi(argv[++i]);
+            if (host_room_count <= 0) {
+                SAM2_LOG_FATAL("--rooms expects a positive number of rooms to host");
+            }
+            g_headless = true;
         } else if (argv[i][0] == '-') {
             SAM2_LOG_FATAL("Unknown option: %s\n", argv[i]);
         }
@@ -2656,6 +3232,14 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    if (host_room_count) {
+#ifdef _WIN32
+        SAM2_LOG_FATAL("--rooms is not supported on Windows");
+#else
+        g_host_room_index = host_rooms_fork_workers(host_room_count);
+#endif
+    }
+
     if (sam2_client_connect(&g_sam2_socket, g_sam2_address, g_sam2_port)) {
         SAM2_LOG_WARN("Failed to connect to Signaling-Server and a Match-Maker\n");
     }
@@ -2702,6 +3286,12 @@ int main(int argc, char *argv[]) {
         g_libretro_context.system_info.library_version
     );
 
+    if (g_host_room_index >= 0) {
+        char room_name[sizeof(g_new_room_set_through_gui.name)];
+        snprintf(room_name, sizeof(room_name), "%s %d", g_new_room_set_through_gui.name, g_host_room_index);
+        memcpy(g_new_room_set_through_gui.name, room_name, sizeof(room_name));
+    }
+
     // Configure the player input devices.
     g_retro.retro_set_controller_port_device(0, RETRO_DEVICE_JOYPAD);
 
@@ -2796,7 +3386,7 @@ int main(int argc, char *argv[]) {
         clock_gettime(CLOCK_MONOTONIC, &start_time);
 #endif
 
-        g_core_wants_tick_in_milliseconds[g_main_loop_cyclic_offset] = core_wants_tick_in_seconds(g_ulnet_session.core_wants_tick_at_unix_usec) * 1000.0;
+        g_core_wants_tick_in_milliseconds[g_main_loop_cyclic_offset] = core_wants_tick_in_seconds(g_ulnet_session.core_wants_tick_at_usec) * 1000.0;
 
         if (!g_headless && !NetImgui::IsConnected()) {
             ImGui_ImplOpenGL3_NewFrame();
@@ -2827,43 +3417,50 @@ int main(int argc, char *argv[]) {
 
 
         g_serialize_size = g_retro.retro_serialize_size();
-        if (g_serialize_size > sizeof(g_savebuffer[g_save_state_index])) {
-            SAM2_LOG_FATAL("Save state buffer is too small (%zu > %zu)", g_serialize_size, sizeof(g_savebuffer[g_save_state_index]));
-        }
-        int status = ulnet_poll_session(&g_ulnet_session, g_do_zstd_compress, g_savebuffer[g_save_state_index], g_serialize_size, g_av.timing.fps,
+        unsigned char *save_state = savebuffer_slot(g_save_state_index, g_serialize_size);
+        int status = ulnet_poll_session(&g_ulnet_session, g_do_zstd_compress, save_state, g_serialize_size, g_av.timing.fps,
             g_retro.retro_run, g_retro.retro_serialize, g_retro.retro_unserialize);
 
         if (g_do_zstd_compress && (status & ULNET_POLL_SESSION_SAVED_STATE)) {
-            tick_compression_investigation((char *)g_savebuffer[g_save_state_index], g_serialize_size, (char*)rom_data, rom_size);
+            tick_compression_investigation((char *)save_state, g_serialize_size, (char*)rom_data, rom_size);
 
             g_save_state_index = (g_save_state_index + 1) % MAX_SAVE_STATES;
         }
 
         if (status & ULNET_POLL_SESSION_TICKED) {
             // Keep track of frame-times for plotting purposes
-            static int64_t last_tick_usec = get_unix_time_microseconds();
-            int64_t current_time_usec = get_unix_time_microseconds();
-            int64_t elapsed_time_milliseconds = (current_time_usec - last_tick_usec) / 1000;
-            g_frame_time_milliseconds[g_frame_cyclic_offset] = elapsed_time_milliseconds;
+            static int64_t last_tick_usec = ulnet_monotonic_usec();
+            int64_t current_time_usec = ulnet_monotonic_usec();
+            g_frame_time_milliseconds[g_frame_cyclic_offset] = (current_time_usec - last_tick_usec) / 1000.0f;
             last_tick_usec = current_time_usec;
 
+            static int64_t last_broadcast_datagrams_sent = 0;
+            static uint64_t last_broadcast_nsec = 0;
+            g_broadcast_datagram_count[g_frame_cyclic_offset] = g_ulnet_session.broadcast_datagrams_sent - last_broadcast_datagrams_sent;
+            g_broadcast_nsec[g_frame_cyclic_offset] = g_ulnet_session.broadcast_nsec - last_broadcast_nsec;
+            last_broadcast_datagrams_sent = g_ulnet_session.broadcast_datagrams_sent;
+            last_broadcast_nsec = g_ulnet_session.broadcast_nsec;
+
             g_frame_cyclic_offset = (g_frame_cyclic_offset + 1) % g_sample_size;
         }
 
-        if (!g_headless) {
+        // While we're catching up the loop only exists to tick the core so nothing gets presented
+        bool present = !(g_ulnet_session.flags & ULNET_SESSION_FLAG_CATCHING_UP);
+
+        if (!g_headless && present) {
             // The imgui frame is updated at the monitor refresh cadence
             // So the core frame needs to be redrawn at the same cadence or you'll get the Windows XP infinite window thing
             draw_core_frame();
         }
 
         // Slight performance save if no one is looking at the imgui
-        if (!g_headless || NetImgui::IsConnected()) {
+        if ((!g_headless || NetImgui::IsConnected()) && present) {
             draw_imgui();
         } else {
             ImGuiJank::EndFrame();
         }
 
-        if (!g_headless) {
+        if (!g_headless && present) {
             // We hope vsync is disabled or else this will block
             // I think you have to write platform specific code / not use OpenGL if you want this to be non-blocking
             // and still try to update on vertical sync or use another thread, but I don't like threads
@@ -2878,6 +3475,14 @@ int main(int argc, char *argv[]) {
 
         g_connected_to_sam2 &= g_sam2_socket != SAM2_SOCKET_INVALID;
         if (g_connected_to_sam2 || (g_connected_to_sam2 = sam2_client_poll_connection(g_sam2_socket, 0))) {
+            if (g_host_room_index >= 0 && !g_host_room_requested) {
+                // Host workers aren't driven through the GUI so they make their room as soon as they can
+                sam2_room_make_message_t request = { SAM2_MAKE_HEADER };
+                request.room = g_new_room_set_through_gui;
+                g_libretro_context.SAM2Send((char *) &request);
+                g_host_room_requested = true;
+            }
+
             for (int _prevent_infinite_loop_counter = 0; _prevent_infinite_loop_counter < 64; _prevent_infinite_loop_counter++) {
                 static sam2_message_u latest_sam2_message; // This is gradually buffered so it has to be static
                 static char buffer[sizeof(sam2_message_u)];
@@ -22,9 +22,11 @@
 // load-balancers/routers might add I keep this conservative
 #define ULNET_PACKET_SIZE_BYTES_MAX 1408
 
-#define ULNET_SPECTATOR_MAX 55
+#define ULNET_SPECTATOR_MAX 55 // Spectators any one peer serves directly. Past the fan-out spectators relay input to each other
+#define ULNET_SPECTATOR_FANOUT_DEFAULT 4 // Default for ulnet_session_t::spectator_fanout
+#define ULNET_RELAY_SDP_PREFIX "a=x-ulnet-relay:" // Signal telling a spectator to get its input through the peer id that follows instead
 #define ULNET_CORE_OPTIONS_MAX 128
-#define ULNET_STATE_PACKET_HISTORY_SIZE 256
+#define ULNET_STATE_PACKET_HISTORY_SIZE 256 // Default for ulnet_session_t::state_packet_history_size
 
 #define ULNET_FLAGS_MASK                      0x0F
 #define ULNET_CHANNEL_MASK                    0xF0
@@ -33,12 +35,15 @@
 #define ULNET_CHANNEL_INPUT                   0x10
 #define ULNET_CHANNEL_INPUT_AUDIT_CONSISTENCY 0x20
 #define ULNET_CHANNEL_SAVESTATE_TRANSFER      0x30
+#define ULNET_CHANNEL_SAVESTATE_FEEDBACK      0x40
 #define ULNET_CHANNEL_DESYNC_DEBUG            0xF0
 
 #define ULNET_WAITING_FOR_SAVE_STATE_SENTINEL INT64_MAX
 
 #define ULNET_SESSION_FLAG_TICKED                 0b00000001ULL
 #define ULNET_SESSION_FLAG_CORE_OPTIONS_DIRTY     0b00000010ULL
+#define ULNET_SESSION_FLAG_RESIMULATING           0b00000100ULL // Set while replaying frames after a misprediction so the frontend can drop audio
+#define ULNET_SESSION_FLAG_CATCHING_UP            0b00001000ULL // Set while a lagging spectator ticks back to back so the frontend can skip presenting frames
 
 // @todo Remove this define once it becomes possible through normal featureset
 #define ULNET__DEBUG_EVERYONE_ON_PORT_0
@@ -61,11 +66,18 @@
 // To handle the case where a peer immediately ticks and sends an input after receiving,
 // the input buffer needs to hold at least 2 frames.
 //
-// Setting ULNET_DELAY_BUFFER_SIZE to 2 allows for no frame delay while still handling this scenario.
-// The following constant is set to 8 which yields 3 frames of delay this corresponds to a max RTT PING of 100 ms to not stutter
-#define ULNET_DELAY_BUFFER_SIZE 8
+// A delay buffer size of 2 allows for no frame delay while still handling this scenario.
+// The size is picked by the authority when it creates the room (ulnet_session_t::delay_buffer_size) and travels with the savestate.
+// The default of 8 yields 3 frames of delay this corresponds to a max RTT PING of 100 ms to not stutter and 32 allows for 15 frames or ~500 ms
+// Input storage is always ULNET_DELAY_BUFFER_SIZE_MAX frames deep, the delay buffer size only limits how many frames are in flight
+#define ULNET_DELAY_BUFFER_SIZE_DEFAULT 8
+#define ULNET_DELAY_BUFFER_SIZE_MAX 32
 
-#define ULNET_DELAY_FRAMES_MAX (ULNET_DELAY_BUFFER_SIZE/2-1)
+#define ULNET_DELAY_FRAMES_MAX(delay_buffer_size) ((delay_buffer_size)/2-1)
+
+// With rollback we tick ahead of remote input by predicting it and resimulate once the real input arrives.
+// Peers can then be ahead of each other by 2 * (delay + rollback) frames and the input ring has to cover that
+#define ULNET_ROLLBACK_FRAMES_MAX(delay_buffer_size) (((delay_buffer_size)-1)/2)
 
 #define ULNET_PORT_COUNT 8
 typedef int16_t ulnet_input_state_t[64]; // This must be a POD for putting into packets
@@ -78,9 +90,9 @@ typedef struct ulnet_core_option {
 // @todo This is really sparse so you should just add routines to read values from it in the serialized format
 typedef struct {
     int64_t frame;
-    ulnet_input_state_t input_state[ULNET_DELAY_BUFFER_SIZE][ULNET_PORT_COUNT];
-    sam2_room_t room_xor_delta[ULNET_DELAY_BUFFER_SIZE];
-    ulnet_core_option_t core_option[ULNET_DELAY_BUFFER_SIZE]; // Max 1 option per frame provided by the authority
+    ulnet_input_state_t input_state[ULNET_DELAY_BUFFER_SIZE_MAX][ULNET_PORT_COUNT];
+    sam2_room_t room_xor_delta[ULNET_DELAY_BUFFER_SIZE_MAX];
+    ulnet_core_option_t core_option[ULNET_DELAY_BUFFER_SIZE_MAX]; // Max 1 option per frame provided by the authority
 } ulnet_state_t;
 SAM2_STATIC_ASSERT(
     sizeof(ulnet_state_t) ==
@@ -91,9 +103,48 @@ SAM2_STATIC_ASSERT(
     "ulnet_state_t is not packed"
 );
 
+// One frame of ulnet_state_t laid out contiguously so runs of empty frames collapse into a single zero run when RLE coded
+typedef struct {
+    ulnet_input_state_t input_state[ULNET_PORT_COUNT];
+    sam2_room_t room_xor_delta;
+    ulnet_core_option_t core_option;
+} ulnet_state_frame_t;
+
+// Spectators decode input packets into a ring of these as they arrive so ticking is a lookup instead of a decode
+typedef struct {
+    int64_t frame; // The frame state_frame holds or -1
+    ulnet_state_frame_t state_frame;
+} ulnet_decoded_frame_t;
+
+#define ULNET_STATE_PACKET_FLAG_KEYFRAME 0b00000001
+
+// Every this many frames we send a keyframe even if every peer acknowledged our input so spectators and peers who lost packets can recover
+#define ULNET_STATE_PACKET_KEYFRAME_INTERVAL 30
+
+// What goes into the RLE coder for an input packet. The frame count isn't sent it falls out of the decoded size
+// Each frame is XOR'd against the frame before it so repeated input codes to zero runs. The oldest frame is XOR'd against
+// the newest frame every peer acknowledged having so normally only unacknowledged frames are sent. Keyframes instead start from
+// zero and hold as many frames as the delay buffer does. Either way if it doesn't fit in a packet we send a keyframe with fewer frames
+typedef struct {
+    int64_t frame;
+    uint8_t flags;
+    int8_t ack_frame_offset[SAM2_PORT_MAX+1]; // frame - the latest frame the sender has from each port or INT8_MIN if it doesn't have a usable one
+    uint8_t spacing[6];
+    ulnet_state_frame_t frames[ULNET_DELAY_BUFFER_SIZE_MAX]; // frames[i] holds frame - i
+} ulnet_state_packed_t;
+SAM2_STATIC_ASSERT(
+    sizeof(ulnet_state_packed_t) ==
+    (sizeof(((ulnet_state_packed_t *)0)->frame)
+    + sizeof(((ulnet_state_packed_t *)0)->flags)
+    + sizeof(((ulnet_state_packed_t *)0)->ack_frame_offset)
+    + sizeof(((ulnet_state_packed_t *)0)->spacing)
+    + ULNET_DELAY_BUFFER_SIZE_MAX * (sizeof(ulnet_input_state_t[ULNET_PORT_COUNT]) + sizeof(sam2_room_t) + sizeof(ulnet_core_option_t))),
+    "ulnet_state_packed_t is not packed"
+);
+
 typedef struct {
     uint8_t channel_and_port;
-    uint8_t coded_state[];
+    uint8_t coded_state[]; // RLE coded ulnet_state_packed_t
 } ulnet_state_packet_t;
 
 // @todo Just roll this all into ulnet_state_t
@@ -102,46 +153,71 @@ typedef struct {
     uint8_t spacing[7];
 
     int64_t frame;
-    int64_t save_state_hash[ULNET_DELAY_BUFFER_SIZE];
-    int64_t input_state_hash[ULNET_DELAY_BUFFER_SIZE];
-    //int64_t options_state_hash[ULNET_DELAY_BUFFER_SIZE]; // @todo
+    int64_t save_state_hash[ULNET_DELAY_BUFFER_SIZE_MAX];
+    int64_t input_state_hash[ULNET_DELAY_BUFFER_SIZE_MAX];
+    //int64_t options_state_hash[ULNET_DELAY_BUFFER_SIZE_MAX]; // @todo
 } desync_debug_packet_t;
 
 #define FEC_PACKET_GROUPS_MAX 16
-#define FEC_REDUNDANT_BLOCKS 16 // ULNET is hardcoded based on this value so it can't really be changed
+// Parity blocks per GF_SIZE block Reed-Solomon group. The number is picked per transfer from the loss we've measured to the peer
+// and sent in every packet header. When we have no measurement yet we fall back on FEC_REDUNDANT_BLOCKS
+#define FEC_REDUNDANT_BLOCKS 16
+#define FEC_REDUNDANT_BLOCKS_MIN 1
+#define FEC_REDUNDANT_BLOCKS_MAX 128
+
+// Save states are paced with a token bucket so we don't overrun socket buffers and cheap routers which just causes the losses FEC has to cover
+#define ULNET_SAVESTATE_TRANSFER_BITRATE_DEFAULT (8 * 1000 * 1000)
+#define ULNET_SAVESTATE_TRANSFER_BITRATE_MIN (256 * 1000)
+#define ULNET_SAVESTATE_TRANSFER_BURST_USEC 50000 // How much unused send time can be saved up between polls
+#define ULNET_SAVESTATE_TRANSFER_BACKOFF_USEC 100000 // Don't back off again for this long; roughly an RTT so we see the effect of the last one
+#define ULNET_SAVESTATE_TRANSFER_LOSS_TOLERANCE 0.05 // Smoothed loss below this is left to FEC and doesn't cause a backoff
+
+#define ULNET_SAVESTATE_FEEDBACK_FLAG_DONE 0b0001
+#define ULNET_SAVESTATE_FEEDBACK_FLAG_NACK 0b0010 // The packet is a ulnet_save_state_nack_packet_t
+#define ULNET_SAVESTATE_FEEDBACK_FLAG_RESYNC 0b0100 // Sent outside of a transfer by spectators who fell further behind than their input history reaches
+#define ULNET_SAVESTATE_FEEDBACK_INTERVAL 32 // Receivers report back every time they get this many packets
+#define ULNET_SAVESTATE_NACK_TIMEOUT_USEC 250000 // Receivers ask for more parity after going this long without a save state packet
+#define ULNET_SAVESTATE_TRANSFER_LINGER_USEC 3000000 // How long we keep a sent save state around to answer NACKs after hearing nothing back
+
+// Receivers send these back to whoever is sending them a save state so it can back off when packets are being lost
+typedef struct {
+    uint8_t channel_and_flags;
+    uint8_t sequence_hi; // Of the newest packet received
+    uint8_t sequence_lo;
+    uint8_t spacing[1];
+    int32_t packets_received; // Every packet of this transfer so far including ones we didn't need
+} ulnet_save_state_feedback_packet_t;
 
-#define ULNET_SAVESTATE_TRANSFER_FLAG_K_IS_239         0b0001
-#define ULNET_SAVESTATE_TRANSFER_FLAG_SEQUENCE_HI_IS_0 0b0010
+// Sent by receivers when a transfer stalls. The sender answers with fresh parity blocks for the groups that are short
+// and only falls back to resending blocks once it runs out of Reed-Solomon indices
+typedef struct {
+    uint8_t channel_and_flags;
+    uint8_t blocks_needed[FEC_PACKET_GROUPS_MAX]; // How many more blocks each packet group needs to be decoded
+    uint8_t blocks_received[FEC_PACKET_GROUPS_MAX][(GF_SIZE + 7) / 8]; // Bitset of Reed-Solomon indices we already have
+} ulnet_save_state_nack_packet_t;
 
-// @todo Just get rid of these
-#define COMPRESSED_SAVE_STATE_BOUND_BYTES ZSTD_COMPRESSBOUND(20 * 1024 * 1024) // @todo Magic number
 #define COMPRESSED_CORE_OPTIONS_BOUND_BYTES ZSTD_COMPRESSBOUND(sizeof(ulnet_core_option_t[ULNET_CORE_OPTIONS_MAX])) // @todo Probably make the type in here a typedef
-#define COMPRESSED_DATA_WITH_REDUNDANCY_BOUND_BYTES (255 * (COMPRESSED_SAVE_STATE_BOUND_BYTES + COMPRESSED_CORE_OPTIONS_BOUND_BYTES) / (255 - FEC_REDUNDANT_BLOCKS))
 
 typedef struct {
     uint8_t channel_and_flags;
-    union {
-        uint8_t reed_solomon_k;
-        uint8_t packet_groups;
-        uint8_t sequence_hi;
-    };
-
+    uint8_t packet_groups;
+    uint8_t reed_solomon_k;
+    uint8_t reed_solomon_n; // Can differ between transfers since the redundancy adapts to loss
+    uint8_t sequence_hi;
     uint8_t sequence_lo;
 
-    //uint8_t payload[]; // Variable size; at most ULNET_PACKET_SIZE_BYTES_MAX-3
+    //uint8_t payload[]; // Variable size; at most ULNET_PACKET_SIZE_BYTES_MAX-6
 } ulnet_save_state_packet_header_t;
 
 typedef struct {
     uint8_t channel_and_flags;
-    union {
-        uint8_t reed_solomon_k;
-        uint8_t packet_groups;
-        uint8_t sequence_hi;
-    };
-
+    uint8_t packet_groups;
+    uint8_t reed_solomon_k;
+    uint8_t reed_solomon_n;
+    uint8_t sequence_hi;
     uint8_t sequence_lo;
 
-    uint8_t payload[ULNET_PACKET_SIZE_BYTES_MAX-3]; // Variable size; at most ULNET_PACKET_SIZE_BYTES_MAX-3
+    uint8_t payload[ULNET_PACKET_SIZE_BYTES_MAX-6]; // Variable size; at most ULNET_PACKET_SIZE_BYTES_MAX-6
 } ulnet_save_state_packet_fragment2_t;
 SAM2_STATIC_ASSERT(sizeof(ulnet_save_state_packet_fragment2_t) == ULNET_PACKET_SIZE_BYTES_MAX, "Savestate transfer is the wrong size");
 
@@ -152,6 +228,10 @@ typedef struct {
     uint64_t encoding_chain; // @todo probably won't use this
     uint64_t xxhash;
 
+    int64_t delay_buffer_size;
+    int64_t delay_frames;
+    int64_t rollback_frames;
+
     int64_t compressed_options_size;
     int64_t compressed_savestate_size;
     int64_t decompressed_savestate_size;
@@ -163,12 +243,23 @@ typedef struct {
 #endif
 } savestate_transfer_payload_t;
 
+// Everything we only need while a save state is on its way to us. Allocated when the first packet of a transfer arrives
+typedef struct ulnet_save_state_receive {
+    void *fec_packet[FEC_PACKET_GROUPS_MAX][GF_SIZE];
+    int fec_index[FEC_PACKET_GROUPS_MAX][GF_SIZE];
+    uint8_t *block[FEC_PACKET_GROUPS_MAX][GF_SIZE]; // Original data blocks we have so far
+    unsigned char compressed_options[COMPRESSED_CORE_OPTIONS_BOUND_BYTES];
+    uint8_t packets[]; // Every packet we've kept so far
+} ulnet_save_state_receive_t;
+
 typedef struct ulnet_session {
     int64_t frame_counter;
     int64_t delay_frames;
-    int64_t core_wants_tick_at_unix_usec;
+    int64_t delay_buffer_size; // How many frames of input can be in flight. Fixed for the lifetime of a room; 0 means ULNET_DELAY_BUFFER_SIZE_DEFAULT
+    int64_t core_wants_tick_at_usec; // On the ulnet_monotonic_usec clock like every other timestamp in here
     int64_t flags;
     uint64_t our_peer_id;
+    int64_t state_packet_history_size; // Input packets we keep for each port. Fixed once any are stored; 0 means ULNET_STATE_PACKET_HISTORY_SIZE
 
     sam2_room_t room_we_are_in;
     uint64_t spectator_peer_ids[ULNET_SPECTATOR_MAX];
@@ -180,21 +271,54 @@ typedef struct ulnet_session {
     juice_agent_t *agent               [SAM2_PORT_MAX + 1 /* Plus Authority */ + ULNET_SPECTATOR_MAX];
     int64_t        peer_desynced_frame [SAM2_PORT_MAX + 1 /* Plus Authority */ + ULNET_SPECTATOR_MAX];
     ulnet_state_t  state               [SAM2_PORT_MAX + 1 /* Plus Authority */];
-    unsigned char  state_packet_history[SAM2_PORT_MAX + 1 /* Plus Authority */][ULNET_STATE_PACKET_HISTORY_SIZE][ULNET_PACKET_SIZE_BYTES_MAX];
+    int64_t        peer_acked_frame    [SAM2_PORT_MAX + 1 /* Plus Authority */]; // Latest frame of our input each peer told us they have or -1
+    int64_t        peer_input_frame_seen[SAM2_PORT_MAX + 1 /* Plus Authority */]; // Newest input packet frame received directly from each peer for measuring loss
+    double         peer_packet_loss    [SAM2_PORT_MAX + 1 /* Plus Authority */ + ULNET_SPECTATOR_MAX]; // Smoothed fraction of packets lost or -1 if we haven't measured it
+    uint8_t       *state_packet_history[SAM2_PORT_MAX + 1 /* Plus Authority */]; // Ring of state_packet_history_size packets allocated once a port is used
+    uint16_t      *state_packet_history_size_bytes[SAM2_PORT_MAX + 1 /* Plus Authority */]; // Parallel to state_packet_history. Size each packet had on the wire
+    ulnet_decoded_frame_t *decoded_frames[SAM2_PORT_MAX + 1 /* Plus Authority */]; // Spectators only. Ring of state_packet_history_size frames indexed by frame
     uint64_t       peer_needs_sync_bitfield;
+    struct ulnet_save_state_job *save_state_job; // Save state we're compressing and sending to peers in the background or NULL
 
     int64_t spectator_count;
+    int64_t spectator_fanout; // Spectators we serve directly before sending new ones down the relay tree. 0 means ULNET_SPECTATOR_FANOUT_DEFAULT
+    int64_t spectator_redirect_counter; // Round-robins the spectators we redirect across the ones below us
+    uint64_t relay_parent_peer_id; // Spectator we get input through instead of the authority or 0. Its agent is agent[SAM2_AUTHORITY_INDEX]
+
+    int64_t rollback_frames; // How many frames we tick ahead of remote input by predicting it. Set by the authority like delay_frames, 0 disables rollback
+    int64_t rollback_confirmed_frame; // Every frame before this one was ticked with the real input of all peers
+    ulnet_input_state_t rollback_input_state[ULNET_DELAY_BUFFER_SIZE_MAX][ULNET_PORT_COUNT]; // The input we fed the core on frames we predicted
+    uint8_t *rollback_save_states; // One save state for every frame we can roll back to each taken right before ticking the frame
+    size_t rollback_save_state_size;
+    int64_t rollback_save_state_count;
 
     desync_debug_packet_t desync_debug_packet;
 
     int zstd_compress_level;
-    unsigned char remote_savestate_transfer_packets[COMPRESSED_DATA_WITH_REDUNDANCY_BOUND_BYTES + FEC_PACKET_GROUPS_MAX * (GF_SIZE - FEC_REDUNDANT_BLOCKS) * sizeof(ulnet_save_state_packet_header_t)];
+    int64_t broadcast_datagrams_sent; // Running totals for profiling broadcasts
+    uint64_t broadcast_nsec; // Only counted with ULNET_IMGUI
+    struct ulnet_save_state_receive *remote_savestate_transfer; // Sized for the transfer in progress when its first packet arrives
+    int64_t remote_savestate_transfer_packets_size_bytes;
     int64_t remote_savestate_transfer_offset;
     uint8_t remote_packet_groups; // This is used to bookkeep how much data we actually need to receive to reform the complete savestate
-    void *fec_packet[FEC_PACKET_GROUPS_MAX][GF_SIZE - FEC_REDUNDANT_BLOCKS];
-    int fec_index[FEC_PACKET_GROUPS_MAX][GF_SIZE - FEC_REDUNDANT_BLOCKS];
+    uint8_t remote_reed_solomon_k;
+    int32_t remote_savestate_transfer_packets_received;
+    int64_t remote_savestate_transfer_packet_at_usec; // When we last got a save state packet or sent a NACK
+    int64_t resync_requested_at_usec; // When we last asked for a fresh save state or 0 if we aren't waiting on one
+    int64_t save_state_transfer_bitrate; // Bits per second we send save states at when there isn't any loss. 0 means ULNET_SAVESTATE_TRANSFER_BITRATE_DEFAULT
     int fec_index_counter[FEC_PACKET_GROUPS_MAX]; // Counts packets received in each "packet group"
 
+    // The save state is hashed and decompressed as a stream while it arrives instead of in one go at the end
+    int remote_savestate_block_size;
+    int64_t remote_savestate_stream_blocks; // Blocks consumed in payload order
+    int64_t remote_savestate_stream_offset_bytes;
+    bool remote_savestate_stream_failed;
+    uint8_t remote_savestate_header[sizeof(savestate_transfer_payload_t)];
+    XXH64_state_t *remote_savestate_xxh64_state;
+    ZSTD_DCtx *remote_savestate_dctx;
+    unsigned char *remote_savestate_data; // Decompressed save state
+    int64_t remote_savestate_data_size_bytes;
+
     void *user_ptr;
     int (*sam2_send_callback)(void *user_ptr, char *response);
     int (*populate_core_options_callback)(void *user_ptr, ulnet_core_option_t options[ULNET_CORE_OPTIONS_MAX]);
@@ -202,11 +326,13 @@ typedef struct ulnet_session {
     bool (*retro_unserialize)(const void *data, size_t size);
 } ulnet_session_t;
 
-ULNET_LINKAGE void ulnet_send_save_state(ulnet_session_t *session, juice_agent_t *agent, void *save_state, size_t save_state_size, int64_t save_state_frame);
+ULNET_LINKAGE int ulnet_send_save_state(ulnet_session_t *session, uint64_t peer_bitfield, void *save_state, size_t save_state_size, int64_t save_state_frame);
 ULNET_LINKAGE int ulnet_startup_ice_for_peer(ulnet_session_t *session, uint64_t peer_id, const char *remote_description);
 ULNET_LINKAGE void ulnet_disconnect_peer(ulnet_session_t *session, int peer_port);
 ULNET_LINKAGE void ulnet_move_peer(ulnet_session_t *session, int peer_existing_port, int peer_new_port);
 ULNET_LINKAGE void ulnet_session_init_defaulted(ulnet_session_t *session);
+ULNET_LINKAGE int64_t ulnet_monotonic_nsec(void);
+ULNET_LINKAGE int64_t ulnet_monotonic_usec(void);
 
 static inline int ulnet_our_port(ulnet_session_t *session) {
     // @todo There is a bug here where we are sending out packets as the authority when we are not the authority
@@ -221,6 +347,10 @@ static inline int ulnet_our_port(ulnet_session_t *session) {
 }
 
 static inline int ulnet_locate_peer(ulnet_session_t *session, uint64_t peer_id) {
+    if (peer_id && peer_id == session->relay_parent_peer_id) {
+        return SAM2_AUTHORITY_INDEX; // Our relay stands in for the authority
+    }
+
     int room_port, spectator_port;
     SAM2_LOCATE(session->room_we_are_in.peer_ids, peer_id, room_port);
     SAM2_LOCATE(session->spectator_peer_ids,      peer_id, spectator_port);
@@ -228,6 +358,15 @@ static inline int ulnet_locate_peer(ulnet_session_t *session, uint64_t peer_id)
     return spectator_port != -1 ? spectator_port + SAM2_PORT_MAX+1 : room_port;
 }
 
+// Ports past the authority are spectators whose ids live outside of the room
+static inline uint64_t *ulnet__peer_id_slot(ulnet_session_t *session, int p) {
+    return p > SAM2_AUTHORITY_INDEX ? &session->spectator_peer_ids[p - (SAM2_PORT_MAX+1)] : &session->room_we_are_in.peer_ids[p];
+}
+
+static inline uint64_t ulnet__peer_id_of_port(ulnet_session_t *session, int p) {
+    return p == SAM2_AUTHORITY_INDEX && session->relay_parent_peer_id ? session->relay_parent_peer_id : *ulnet__peer_id_slot(session, p);
+}
+
 static bool ulnet_is_authority(ulnet_session_t *session) {
     return    session->our_peer_id == session->room_we_are_in.peer_ids[SAM2_AUTHORITY_INDEX]
            || session->room_we_are_in.peer_ids[SAM2_AUTHORITY_INDEX] == 0; // @todo I don't think this extra check should be necessary
@@ -264,16 +403,602 @@ static void ulnet__logical_partition(int sz, int redundant, int *n, int *out_k,
         k = (sz - 1) / (*packet_groups * *packet_size) + 1;
     }
 
-    *n = k + k * redundant / k_max;
+    *n = k + (k * redundant + k_max - 1) / k_max; // Rounded up so even tiny payloads get at least one parity block
     *out_k = k;
 }
 
-// This is a little confusing since the lower byte of sequence corresponds to the largest stride
-static int64_t ulnet__logical_partition_offset_bytes(uint8_t sequence_hi, uint8_t sequence_lo, int block_size_bytes, int block_stride) {
-    return (int64_t) sequence_hi * block_size_bytes + sequence_lo * block_size_bytes * block_stride;
+// Enough parity that a group nearly always decodes at this loss rate. Roughly two standard deviations above the
+// expected number of lost blocks per group for the loss rates we care about plus a little slack for a clean link
+static int ulnet__fec_redundant_blocks(double packet_loss) {
+    if (packet_loss < 0.0) {
+        return FEC_REDUNDANT_BLOCKS;
+    }
+
+    int redundant = (int) (GF_SIZE * (2.0 * packet_loss + 0.01)) + 1;
+    return SAM2_MAX(FEC_REDUNDANT_BLOCKS_MIN, SAM2_MIN(FEC_REDUNDANT_BLOCKS_MAX, redundant));
 }
 
-ULNET_LINKAGE void ulnet_input_poll(ulnet_session_t *session, ulnet_input_state_t (*input_state)[ULNET_PORT_COUNT]) {
+// Outgoing save states keep every block in its own slot with the packet header written right in front of it so packets go
+// straight from the buffer to juice_send without being copied. The padding keeps blocks 8-byte aligned: [pad][header][block]
+// Slots are in stream order which is a little confusing since the lower byte of sequence corresponds to the largest stride
+#define ULNET_SAVESTATE_SLOT_BLOCK_OFFSET 8
+SAM2_STATIC_ASSERT(sizeof(ulnet_save_state_packet_header_t) <= ULNET_SAVESTATE_SLOT_BLOCK_OFFSET, "Packet header doesn't fit in front of the block");
+
+static int64_t ulnet__save_state_slot_stride(int block_size_bytes) {
+    return (ULNET_SAVESTATE_SLOT_BLOCK_OFFSET + block_size_bytes + 7) & ~7;
+}
+
+static uint8_t *ulnet__save_state_slot_block(uint8_t *slots, uint8_t sequence_hi, uint8_t sequence_lo, int block_size_bytes, int packet_groups) {
+    return slots + ((int64_t) sequence_lo * packet_groups + sequence_hi) * ulnet__save_state_slot_stride(block_size_bytes) + ULNET_SAVESTATE_SLOT_BLOCK_OFFSET;
+}
+
+static void ulnet__save_state_slot_write_header(uint8_t *block, int packet_groups, int k, int n, uint8_t sequence_hi, uint8_t sequence_lo) {
+    ulnet_save_state_packet_header_t header;
+    header.channel_and_flags = ULNET_CHANNEL_SAVESTATE_TRANSFER;
+    header.packet_groups = (uint8_t) packet_groups;
+    header.reed_solomon_k = (uint8_t) k;
+    header.reed_solomon_n = (uint8_t) n;
+    header.sequence_hi = sequence_hi;
+    header.sequence_lo = sequence_lo;
+    memcpy(block - sizeof(header), &header, sizeof(header));
+}
+
+// MARK: Threads
+#if defined(_WIN32)
+typedef HANDLE ulnet__thread_t;
+typedef CRITICAL_SECTION ulnet__mutex_t;
+#define ULNET__THREAD_PROC(name) static DWORD WINAPI name(LPVOID arg)
+
+static bool ulnet__thread_create(ulnet__thread_t *thread, LPTHREAD_START_ROUTINE proc, void *arg) {
+    *thread = CreateThread(NULL, 0, proc, arg, 0, NULL);
+    return *thread != NULL;
+}
+static void ulnet__thread_detach(ulnet__thread_t thread) { CloseHandle(thread); }
+static void ulnet__mutex_init(ulnet__mutex_t *mutex) { InitializeCriticalSection(mutex); }
+static void ulnet__mutex_destroy(ulnet__mutex_t *mutex) { DeleteCriticalSection(mutex); }
+static void ulnet__mutex_lock(ulnet__mutex_t *mutex) { EnterCriticalSection(mutex); }
+static void ulnet__mutex_unlock(ulnet__mutex_t *mutex) { LeaveCriticalSection(mutex); }
+#else
+#include <pthread.h>
+typedef pthread_t ulnet__thread_t;
+typedef pthread_mutex_t ulnet__mutex_t;
+#define ULNET__THREAD_PROC(name) static void *name(void *arg)
+
+static bool ulnet__thread_create(ulnet__thread_t *thread, void *(*proc)(void *), void *arg) {
+    return pthread_create(thread, NULL, proc, arg) == 0;
+}
+static void ulnet__thread_detach(ulnet__thread_t thread) { pthread_detach(thread); }
+static void ulnet__mutex_init(ulnet__mutex_t *mutex) { pthread_mutex_init(mutex, NULL); }
+static void ulnet__mutex_destroy(ulnet__mutex_t *mutex) { pthread_mutex_destroy(mutex); }
+static void ulnet__mutex_lock(ulnet__mutex_t *mutex) { pthread_mutex_lock(mutex); }
+static void ulnet__mutex_unlock(ulnet__mutex_t *mutex) { pthread_mutex_unlock(mutex); }
+#endif
+
+// MARK: Save state transfer job
+// Compressing, hashing, and computing parity for a save state takes many frames worth of time for large states
+// so it happens on a worker thread. The main thread sends packets out of the job from ulnet_poll_session as they become ready
+typedef struct ulnet_save_state_job {
+    ulnet__thread_t thread;
+    ulnet__mutex_t mutex;
+    int references; // Guarded by the mutex. The session and the worker each hold one and whoever lets go last frees the job
+
+    // Inputs. Copied out of the session up front so the worker never touches it
+    uint8_t *save_state;
+    size_t save_state_size;
+    int64_t save_state_frame;
+    sam2_room_t room;
+    int64_t delay_buffer_size;
+    int64_t delay_frames;
+    int64_t rollback_frames;
+    ulnet_core_option_t core_options[ULNET_CORE_OPTIONS_MAX];
+    int zstd_compress_level;
+    int redundant_blocks;
+
+    // Outputs. Only read these after observing groups_encoded >= 0 under the mutex
+    uint8_t *slots; // Every data and parity block along with its packet header. See ulnet__save_state_slot_block
+    savestate_transfer_payload_t *payload; // Points at the first block
+    int n, k, packet_groups, packet_payload_size_bytes;
+
+    // Guarded by the mutex
+    int groups_encoded; // -1 until the payload is compressed and hashed then the number of packet groups with parity blocks
+    bool failed;
+    bool cancelled;
+
+    // Main thread only
+    juice_agent_t *agent[SAM2_PORT_MAX + 1 /* Plus Authority */ + ULNET_SPECTATOR_MAX]; // NULL'd if the peer disconnects mid-transfer or has the whole state
+    int32_t feedback_packets_received[SAM2_PORT_MAX + 1 /* Plus Authority */ + ULNET_SPECTATOR_MAX];
+    int64_t feedback_send_index[SAM2_PORT_MAX + 1 /* Plus Authority */ + ULNET_SPECTATOR_MAX];
+    double feedback_loss[SAM2_PORT_MAX + 1 /* Plus Authority */ + ULNET_SPECTATOR_MAX]; // Smoothed since a single feedback interval is only a few packets
+    int data_packets_sent;
+    int parity_packets_sent;
+    int64_t heard_from_peers_at_usec; // Last feedback or NACK. We give up on peers who go quiet once everything is sent
+
+    // Extra blocks generated to answer NACKs. They're sent after everything else
+    void *repair_rs_code; // Can make parity blocks for every index up to GF_SIZE
+    uint8_t *repair_slots; // Slots for parity indices n through GF_SIZE-1 which are only made once a NACK asks for them
+    uint8_t **repair_packets; // Queue of packets to send. Each points into slots or repair_slots
+    int repair_packet_count;
+    int repair_packets_sent;
+    int repair_next_index[FEC_PACKET_GROUPS_MAX]; // Next unsent Reed-Solomon index. Once we run out we resend old blocks from resend_index
+    int repair_resend_index[FEC_PACKET_GROUPS_MAX];
+
+    double bitrate; // Current rate after backing off for loss
+    double tokens_bytes;
+    int64_t tokens_refilled_at_usec;
+    int64_t backed_off_at_usec;
+} ulnet_save_state_job_t;
+
+static void ulnet__save_state_job_run(ulnet_save_state_job_t *job) {
+    int packet_payload_size_bytes = ULNET_PACKET_SIZE_BYTES_MAX - sizeof(ulnet_save_state_packet_header_t);
+    int n, k, packet_groups;
+
+    int64_t save_state_transfer_payload_compressed_bound_size_bytes = ZSTD_COMPRESSBOUND(job->save_state_size) + ZSTD_COMPRESSBOUND(sizeof(job->core_options));
+    ulnet__logical_partition(sizeof(savestate_transfer_payload_t) /* Header */ + save_state_transfer_payload_compressed_bound_size_bytes,
+                      job->redundant_blocks, &n, &k, &packet_payload_size_bytes, &packet_groups);
+
+    size_t slots_bound_bytes = packet_groups * n * ulnet__save_state_slot_stride(packet_payload_size_bytes);
+
+    // The payload is compressed and hashed as one contiguous run at the front of this buffer then spread out into slots
+    // where the parity blocks are computed in place and packets get sent from directly
+    uint8_t *slots = (uint8_t *) malloc(slots_bound_bytes);
+    savestate_transfer_payload_t *savestate_transfer_payload = (savestate_transfer_payload_t *) slots;
+
+    savestate_transfer_payload->decompressed_savestate_size = job->save_state_size;
+    savestate_transfer_payload->compressed_savestate_size = ZSTD_compress(
+        savestate_transfer_payload->compressed_data,
+        save_state_transfer_payload_compressed_bound_size_bytes,
+        job->save_state, job->save_state_size, job->zstd_compress_level
+    );
+
+    // We're done with the copy of the save state so release it early since it can be quite large
+    free(job->save_state);
+    job->save_state = NULL;
+
+    ulnet__mutex_lock(&job->mutex);
+    bool cancelled_while_compressing = job->cancelled;
+    ulnet__mutex_unlock(&job->mutex);
+    if (cancelled_while_compressing) goto failed;
+
+    if (ZSTD_isError(savestate_transfer_payload->compressed_savestate_size)) {
+        SAM2_LOG_ERROR("ZSTD_compress failed: %s", ZSTD_getErrorName(savestate_transfer_payload->compressed_savestate_size));
+        goto failed;
+    }
+
+    savestate_transfer_payload->compressed_options_size = ZSTD_compress(
+        savestate_transfer_payload->compressed_data + savestate_transfer_payload->compressed_savestate_size,
+        save_state_transfer_payload_compressed_bound_size_bytes - savestate_transfer_payload->compressed_savestate_size,
+        job->core_options, sizeof(job->core_options), job->zstd_compress_level
+    );
+
+    if (ZSTD_isError(savestate_transfer_payload->compressed_options_size)) {
+        SAM2_LOG_ERROR("ZSTD_compress failed: %s", ZSTD_getErrorName(savestate_transfer_payload->compressed_options_size));
+        goto failed;
+    }
+
+    { // Scoped to keep the goto above legal in C++
+    int64_t payload_size_bytes = sizeof(savestate_transfer_payload_t) /* Header */ + savestate_transfer_payload->compressed_savestate_size + savestate_transfer_payload->compressed_options_size;
+
+    // Every block has to fit in FEC_PACKET_GROUPS_MAX packet groups so big states give up some redundancy to make room
+    packet_payload_size_bytes = ULNET_PACKET_SIZE_BYTES_MAX - sizeof(ulnet_save_state_packet_header_t);
+    int64_t block_count = (payload_size_bytes - 1) / packet_payload_size_bytes + 1;
+    int redundant_blocks = (int) SAM2_MIN(job->redundant_blocks, GF_SIZE - ((block_count - 1) / FEC_PACKET_GROUPS_MAX + 1));
+    if (redundant_blocks < FEC_REDUNDANT_BLOCKS_MIN) {
+        SAM2_LOG_ERROR("Save state is too large to send: %" PRId64 " bytes compressed", payload_size_bytes);
+        goto failed;
+    } else if (redundant_blocks < job->redundant_blocks) {
+        SAM2_LOG_WARN("Save state is large so we can only send %d parity blocks per group instead of %d", redundant_blocks, job->redundant_blocks);
+    }
+
+    ulnet__logical_partition(payload_size_bytes, redundant_blocks, &n, &k, &packet_payload_size_bytes, &packet_groups);
+
+    // Less redundancy can need slightly more space when the blocks get rounded up
+    size_t slots_size_bytes = (size_t) packet_groups * n * ulnet__save_state_slot_stride(packet_payload_size_bytes);
+    if (slots_bound_bytes < slots_size_bytes) {
+        slots = (uint8_t *) realloc(slots, slots_size_bytes);
+        savestate_transfer_payload = (savestate_transfer_payload_t *) slots;
+    }
+    }
+
+    savestate_transfer_payload->frame_counter = job->save_state_frame;
+    savestate_transfer_payload->room = job->room;
+    savestate_transfer_payload->delay_buffer_size = job->delay_buffer_size;
+    savestate_transfer_payload->delay_frames = job->delay_frames;
+    savestate_transfer_payload->rollback_frames = job->rollback_frames;
+    savestate_transfer_payload->total_size_bytes = sizeof(savestate_transfer_payload_t) + savestate_transfer_payload->compressed_savestate_size + savestate_transfer_payload->compressed_options_size;
+
+    savestate_transfer_payload->xxhash = 0;
+    savestate_transfer_payload->xxhash = ZSTD_XXH64(savestate_transfer_payload, savestate_transfer_payload->total_size_bytes, 0);
+
+    // The last data blocks run past the payload and go out as is, so zero the rest instead of sending whatever was on the heap
+    memset((uint8_t *) savestate_transfer_payload + savestate_transfer_payload->total_size_bytes, 0,
+           (size_t) k * packet_groups * packet_payload_size_bytes - savestate_transfer_payload->total_size_bytes);
+
+    // This is the only time the payload gets copied after compression. Back to front since every block moves forward
+    for (int s = k * packet_groups - 1; s >= 0; s--) {
+        memmove(ulnet__save_state_slot_block(slots, s % packet_groups, s / packet_groups, packet_payload_size_bytes, packet_groups),
+                slots + (int64_t) s * packet_payload_size_bytes, packet_payload_size_bytes);
+    }
+
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < packet_groups; j++) {
+            ulnet__save_state_slot_write_header(ulnet__save_state_slot_block(slots, j, i, packet_payload_size_bytes, packet_groups), packet_groups, k, n, j, i);
+        }
+    }
+
+    savestate_transfer_payload = (savestate_transfer_payload_t *) ulnet__save_state_slot_block(slots, 0, 0, packet_payload_size_bytes, packet_groups);
+
+    // The original data blocks can go out while we're still computing parity
+    ulnet__mutex_lock(&job->mutex);
+    job->slots = slots;
+    job->payload = savestate_transfer_payload;
+    job->n = n;
+    job->k = k;
+    job->packet_groups = packet_groups;
+    job->packet_payload_size_bytes = packet_payload_size_bytes;
+    job->groups_encoded = 0;
+    ulnet__mutex_unlock(&job->mutex);
+
+    { // Scoped to keep the goto above legal in C++
+    // Create parity blocks for Reed-Solomon. n - k in total for each packet group
+    // We have "packet grouping" because pretty much every implementation of Reed-Solomon doesn't support more than 255 blocks
+    // and unfragmented UDP packets over ethernet are limited to ULNET_PACKET_SIZE_BYTES_MAX
+    // This makes the code more complicated and the error correcting properties slightly worse but it's a practical tradeoff
+    // Groups are encoded one at a time so the main thread can start sending while we work on the rest,
+    // but each one is split by byte range across fec.c's thread pool
+    void *rs_code = fec_new(k, n);
+    for (int j = 0; j < packet_groups; j++) {
+        void *data[255];
+        void **groups[1] = { data };
+
+        for (int i = 0; i < n; i++) {
+            data[i] = ulnet__save_state_slot_block(slots, j, i, packet_payload_size_bytes, packet_groups);
+        }
+
+        fec_encode_batch(rs_code, groups, 1, packet_payload_size_bytes);
+
+        ulnet__mutex_lock(&job->mutex);
+        job->groups_encoded = j + 1;
+        bool cancelled = job->cancelled;
+        ulnet__mutex_unlock(&job->mutex);
+
+        if (cancelled) break;
+    }
+    fec_free(rs_code);
+    }
+
+    return;
+
+failed:
+    free(slots);
+    ulnet__mutex_lock(&job->mutex);
+    job->failed = true;
+    ulnet__mutex_unlock(&job->mutex);
+}
+
+static void ulnet__save_state_job_release(ulnet_save_state_job_t *job) {
+    ulnet__mutex_lock(&job->mutex);
+    bool last_reference = --job->references == 0;
+    ulnet__mutex_unlock(&job->mutex);
+    if (!last_reference) return;
+
+    ulnet__mutex_destroy(&job->mutex);
+    if (job->repair_rs_code) fec_free(job->repair_rs_code);
+    free(job->repair_packets);
+    free(job->repair_slots);
+    free(job->save_state);
+    free(job->slots);
+    free(job);
+}
+
+ULNET__THREAD_PROC(ulnet__save_state_job_thread) {
+    ulnet__save_state_job_run((ulnet_save_state_job_t *) arg);
+    ulnet__save_state_job_release((ulnet_save_state_job_t *) arg);
+    return 0;
+}
+
+// Never waits on the worker since it can be in the middle of compressing a large state. It stops at the next check of cancelled
+static void ulnet__save_state_job_free(ulnet_session_t *session) {
+    ulnet_save_state_job_t *job = session->save_state_job;
+    if (!job) return;
+
+    session->save_state_job = NULL;
+    ulnet__mutex_lock(&job->mutex);
+    job->cancelled = true;
+    ulnet__mutex_unlock(&job->mutex);
+    ulnet__save_state_job_release(job);
+}
+
+static double ulnet__save_state_transfer_bitrate_max(ulnet_session_t *session) {
+    return (double) SAM2_MAX(ULNET_SAVESTATE_TRANSFER_BITRATE_MIN,
+        session->save_state_transfer_bitrate ? session->save_state_transfer_bitrate : ULNET_SAVESTATE_TRANSFER_BITRATE_DEFAULT);
+}
+
+// Position of a block in the order ulnet__save_state_job_send_packets sends them
+static int64_t ulnet__save_state_job_send_index(ulnet_save_state_job_t *job, int sequence_hi, int sequence_lo) {
+    if (sequence_lo < job->k) {
+        return (int64_t) sequence_lo * job->packet_groups + sequence_hi;
+    } else {
+        return (int64_t) job->k * job->packet_groups + sequence_hi * (job->n - job->k) + (sequence_lo - job->k);
+    }
+}
+
+// The worker fills in the outputs under the mutex before groups_encoded goes from -1 to 0 and doesn't change them after,
+// so once the main thread sees a value >= 0 here it can read them without the lock
+static int ulnet__save_state_job_groups_encoded(ulnet_save_state_job_t *job) {
+    ulnet__mutex_lock(&job->mutex);
+    int groups_encoded = job->groups_encoded;
+    ulnet__mutex_unlock(&job->mutex);
+    return groups_encoded;
+}
+
+// Additive increase, multiplicative decrease like TCP. Loss is measured over the packets sent between two feedback packets
+static void ulnet__save_state_job_on_feedback(ulnet_session_t *session, int p, ulnet_save_state_feedback_packet_t *feedback, int64_t current_time_usec) {
+    ulnet_save_state_job_t *job = session->save_state_job;
+    if (!job || !job->agent[p] || ulnet__save_state_job_groups_encoded(job) < 0) return;
+
+    if (feedback->channel_and_flags & ULNET_SAVESTATE_FEEDBACK_FLAG_DONE) {
+        SAM2_LOG_INFO("Peer on port %d has the whole save state; we can stop sending to them", p);
+        job->agent[p] = NULL;
+        return;
+    }
+
+    job->heard_from_peers_at_usec = current_time_usec;
+
+    if (   feedback->sequence_hi >= job->packet_groups
+        || feedback->sequence_lo >= job->n) {
+        return; // Repair blocks don't have a position in the original send order
+    }
+
+    int64_t send_index = ulnet__save_state_job_send_index(job, feedback->sequence_hi, feedback->sequence_lo);
+    int64_t packets_sent = send_index - job->feedback_send_index[p];
+    int64_t packets_received = feedback->packets_received - job->feedback_packets_received[p];
+    if (packets_sent <= 0) return; // Reordered
+
+    job->feedback_send_index[p] = send_index;
+    job->feedback_packets_received[p] = feedback->packets_received;
+
+    double loss = SAM2_MAX(0.0, 1.0 - (double) packets_received / packets_sent);
+    job->feedback_loss[p] += (loss - job->feedback_loss[p]) / 4;
+    session->peer_packet_loss[p] = job->feedback_loss[p]; // Better than what we get from input since it's the direction we care about
+
+    double bitrate_max = ulnet__save_state_transfer_bitrate_max(session);
+    if (job->feedback_loss[p] > ULNET_SAVESTATE_TRANSFER_LOSS_TOLERANCE) {
+        if (current_time_usec - job->backed_off_at_usec >= ULNET_SAVESTATE_TRANSFER_BACKOFF_USEC) {
+            job->bitrate = SAM2_MAX(ULNET_SAVESTATE_TRANSFER_BITRATE_MIN, job->bitrate * 0.75);
+            job->backed_off_at_usec = current_time_usec;
+            SAM2_LOG_DEBUG("Save state transfer to port %d is losing %.1f%% of packets; backing off to %.0f kbit/s", p, 100.0 * job->feedback_loss[p], job->bitrate / 1000.0);
+        }
+    } else {
+        job->bitrate = SAM2_MIN(bitrate_max, job->bitrate + bitrate_max / 16);
+    }
+}
+
+static void ulnet__save_state_job_on_nack(ulnet_session_t *session, int p, ulnet_save_state_nack_packet_t *nack, int64_t current_time_usec) {
+    ulnet_save_state_job_t *job = session->save_state_job;
+    if (!job || !job->agent[p]) return;
+
+    // Repair parity is made from the slots so wait until the worker is completely done with them
+    int groups_encoded = ulnet__save_state_job_groups_encoded(job);
+    if (groups_encoded < 0 || groups_encoded < job->packet_groups) return;
+
+    job->heard_from_peers_at_usec = current_time_usec;
+
+    // Until everything's been sent once the blocks they're missing are probably still on the way. Likewise for an earlier repair
+    if (   job->data_packets_sent < job->k * job->packet_groups
+        || job->parity_packets_sent < (job->n - job->k) * job->packet_groups
+        || job->repair_packets_sent < job->repair_packet_count) {
+        return;
+    }
+
+    if (!job->repair_rs_code) {
+        job->repair_rs_code = fec_new(job->k, GF_SIZE);
+        job->repair_slots = (uint8_t *) malloc((size_t) job->packet_groups * (GF_SIZE - job->n) * ulnet__save_state_slot_stride(job->packet_payload_size_bytes) + 1 /* n can be GF_SIZE */);
+        for (int j = 0; j < job->packet_groups; j++) {
+            job->repair_next_index[j] = job->n;
+        }
+    }
+
+    double packet_loss = SAM2_MAX(0.0, session->peer_packet_loss[p]);
+    for (int j = 0; j < job->packet_groups; j++) {
+        int blocks_needed = SAM2_MIN(nack->blocks_needed[j], job->k);
+        if (blocks_needed == 0) continue;
+
+        // Pad it out for loss so we don't have to go through another round trip
+        int blocks_to_send = blocks_needed + (int) (blocks_needed * 2.0 * packet_loss) + 1;
+        SAM2_LOG_INFO("Peer on port %d needs %d more blocks for packet group %d sending %d", p, blocks_needed, j, blocks_to_send);
+
+        void *data[GF_SIZE];
+        for (int i = 0; i < job->k; i++) {
+            data[i] = ulnet__save_state_slot_block(job->slots, j, i, job->packet_payload_size_bytes, job->packet_groups);
+        }
+
+        job->repair_packets = (uint8_t **) realloc(job->repair_packets, (job->repair_packet_count + blocks_to_send) * sizeof(uint8_t *));
+        for (int b = 0; b < blocks_to_send; b++) {
+            int index = -1;
+            bool new_parity = false;
+            if (job->repair_next_index[j] < GF_SIZE) {
+                index = job->repair_next_index[j]++;
+                new_parity = index >= job->n;
+            } else {
+                // We're out of new parity rows so resend whatever they told us they're missing
+                for (int tries = 0; tries < GF_SIZE && index == -1; tries++) {
+                    int candidate = job->repair_resend_index[j]++ % GF_SIZE;
+                    if (!(nack->blocks_received[j][candidate / 8] & (1 << candidate % 8))) {
+                        index = candidate;
+                    }
+                }
+            }
+
+            if (index == -1) break;
+
+            // Blocks we already have go out of their original slot. Receivers only need k, the packet groups, and the block size to
+            // match so the n in that header is fine. New parity rows are made the first time they're asked for and kept for resends
+            uint8_t *block;
+            if (index < job->n) {
+                block = ulnet__save_state_slot_block(job->slots, j, index, job->packet_payload_size_bytes, job->packet_groups);
+            } else {
+                block = ulnet__save_state_slot_block(job->repair_slots, j, index - job->n, job->packet_payload_size_bytes, job->packet_groups);
+                if (new_parity) {
+                    ulnet__save_state_slot_write_header(block, job->packet_groups, job->k, GF_SIZE, j, index);
+                    fec_encode(job->repair_rs_code, data, block, index, job->packet_payload_size_bytes);
+                }
+            }
+
+            job->repair_packets[job->repair_packet_count++] = block - sizeof(ulnet_save_state_packet_header_t);
+        }
+    }
+}
+
+static void ulnet__save_state_job_forget_agent(ulnet_session_t *session, juice_agent_t *agent) {
+    if (!session->save_state_job) return;
+
+    for (int p = 0; p < SAM2_ARRAY_LENGTH(session->save_state_job->agent); p++) {
+        if (session->save_state_job->agent[p] == agent) {
+            session->save_state_job->agent[p] = NULL;
+        }
+    }
+}
+
+// Sends whatever packets the worker has finished since the last call as fast as the pacer allows. Original data blocks are
+// interleaved across packet groups and go out first, then parity blocks are sent one packet group at a time as soon as each group is encoded
+// and finally any blocks we made to answer NACKs
+static void ulnet__save_state_job_send_packets(ulnet_session_t *session, int64_t current_time_usec) {
+    ulnet_save_state_job_t *job = session->save_state_job;
+    if (!job) return;
+
+    ulnet__mutex_lock(&job->mutex);
+    int groups_encoded = job->groups_encoded;
+    bool failed = job->failed;
+    ulnet__mutex_unlock(&job->mutex);
+
+    bool any_destination = false;
+    for (int p = 0; p < SAM2_ARRAY_LENGTH(job->agent); p++) {
+        any_destination |= job->agent[p] != NULL;
+    }
+
+    if (failed || !any_destination) {
+        ulnet__save_state_job_free(session);
+        return;
+    }
+
+    if (groups_encoded < 0) return; // Still compressing
+
+    int data_packet_count = job->k * job->packet_groups;
+    int parity_packet_count = (job->n - job->k) * job->packet_groups;
+    int parity_packets_ready = (job->n - job->k) * groups_encoded;
+    int packet_size_bytes = sizeof(ulnet_save_state_packet_header_t) + job->packet_payload_size_bytes;
+
+    // Refill the token bucket. Every destination gets every packet so they all share one bucket and the bitrate is per peer
+    if (job->tokens_refilled_at_usec == 0) {
+        job->bitrate = ulnet__save_state_transfer_bitrate_max(session);
+        job->tokens_bytes = packet_size_bytes;
+    } else {
+        double burst_bytes = SAM2_MAX(packet_size_bytes, job->bitrate / 8 * ULNET_SAVESTATE_TRANSFER_BURST_USEC / 1e6);
+        job->bitrate = SAM2_MIN(job->bitrate, ulnet__save_state_transfer_bitrate_max(session));
+        job->tokens_bytes += job->bitrate / 8 * (current_time_usec - job->tokens_refilled_at_usec) / 1e6;
+        job->tokens_bytes = SAM2_MIN(job->tokens_bytes, burst_bytes);
+    }
+    job->tokens_refilled_at_usec = current_time_usec;
+
+    for (; job->tokens_bytes >= packet_size_bytes; job->tokens_bytes -= packet_size_bytes) {
+        uint8_t *packet_to_send = NULL;
+        int i, j;
+        if (job->data_packets_sent < data_packet_count) {
+            i = job->data_packets_sent / job->packet_groups;
+            j = job->data_packets_sent % job->packet_groups;
+            job->data_packets_sent++;
+        } else if (job->parity_packets_sent < parity_packets_ready) {
+            i = job->k + job->parity_packets_sent % (job->n - job->k);
+            j = job->parity_packets_sent / (job->n - job->k);
+            job->parity_packets_sent++;
+
+            if (job->parity_packets_sent == parity_packet_count) {
+                SAM2_LOG_INFO("Finished sending save state for frame %" PRId64, job->payload->frame_counter);
+                job->heard_from_peers_at_usec = current_time_usec;
+            }
+        } else if (job->repair_packets_sent < job->repair_packet_count) {
+            packet_to_send = job->repair_packets[job->repair_packets_sent++];
+        } else {
+            break;
+        }
+
+        if (!packet_to_send) {
+            packet_to_send = ulnet__save_state_slot_block(job->slots, j, i, job->packet_payload_size_bytes, job->packet_groups) - sizeof(ulnet_save_state_packet_header_t);
+        }
+
+        for (int p = 0; p < SAM2_ARRAY_LENGTH(job->agent); p++) {
+            if (!job->agent[p]) continue;
+            int status = juice_send(job->agent[p], (char *) packet_to_send, packet_size_bytes);
+            assert(status == 0);
+        }
+    }
+
+    // Everything is sent so we're just waiting to hear that peers got it or to answer NACKs
+    if (   job->data_packets_sent == data_packet_count
+        && job->parity_packets_sent == parity_packet_count
+        && job->repair_packets_sent == job->repair_packet_count
+        && current_time_usec - job->heard_from_peers_at_usec > ULNET_SAVESTATE_TRANSFER_LINGER_USEC) {
+        SAM2_LOG_INFO("Done waiting on NACKs for save state for frame %" PRId64 " not every peer confirmed they received it", job->payload->frame_counter);
+        ulnet__save_state_job_free(session);
+    }
+}
+
+// Receivers ask for more blocks for the packet groups they can't decode yet when a transfer stops making progress
+static void ulnet__save_state_nack_if_stalled(ulnet_session_t *session, int64_t current_time_usec) {
+    if (   session->frame_counter != ULNET_WAITING_FOR_SAVE_STATE_SENTINEL
+        || !session->agent[SAM2_AUTHORITY_INDEX]
+        || session->remote_savestate_transfer_packets_received == 0
+        || current_time_usec - session->remote_savestate_transfer_packet_at_usec < ULNET_SAVESTATE_NACK_TIMEOUT_USEC) {
+        return;
+    }
+
+    ulnet_save_state_nack_packet_t nack = {0};
+    nack.channel_and_flags = ULNET_CHANNEL_SAVESTATE_FEEDBACK | ULNET_SAVESTATE_FEEDBACK_FLAG_NACK;
+    for (int j = 0; j < session->remote_packet_groups && j < FEC_PACKET_GROUPS_MAX; j++) {
+        nack.blocks_needed[j] = (uint8_t) SAM2_MAX(0, session->remote_reed_solomon_k - session->fec_index_counter[j]);
+        for (int i = 0; i < session->fec_index_counter[j]; i++) {
+            int index = session->remote_savestate_transfer->fec_index[j][i];
+            nack.blocks_received[j][index / 8] |= 1 << index % 8;
+        }
+    }
+
+    SAM2_LOG_INFO("Save state transfer stalled; asking for more blocks");
+    juice_send(session->agent[SAM2_AUTHORITY_INDEX], (char *) &nack, sizeof(nack));
+    session->remote_savestate_transfer_packet_at_usec = current_time_usec;
+}
+
+// Rollback is only worth it while we're exchanging input with other peers. Spectators always wait for real input
+static inline int64_t ulnet__rollback_frames(ulnet_session_t *session) {
+    if (   !(session->room_we_are_in.flags & SAM2_FLAG_ROOM_IS_NETWORK_HOSTED)
+        || ulnet_is_spectator(session, session->our_peer_id)) {
+        return 0;
+    }
+
+    return SAM2_MAX(0, SAM2_MIN(session->rollback_frames, ULNET_ROLLBACK_FRAMES_MAX(session->delay_buffer_size) - session->delay_frames));
+}
+
+// We only ever roll back to frames within the rollback window so we only keep that many save states around
+static inline uint8_t *ulnet__rollback_save_state(ulnet_session_t *session, int64_t frame) {
+    return session->rollback_save_states + (frame % session->rollback_save_state_count) * session->rollback_save_state_size;
+}
+
+// The first frame we don't have input for from every peer yet. This is only ever one past the current frame
+static int64_t ulnet__confirmed_frame(ulnet_session_t *session) {
+    int64_t confirmed_frame = session->frame_counter + 1;
+    if (!(session->room_we_are_in.flags & SAM2_FLAG_ROOM_IS_NETWORK_HOSTED)) {
+        return confirmed_frame;
+    }
+
+    for (int p = 0; p < SAM2_PORT_MAX+1; p++) {
+        if (session->room_we_are_in.peer_ids[p] <= SAM2_PORT_SENTINELS_MAX) continue;
+        confirmed_frame = SAM2_MIN(confirmed_frame, session->state[p].frame + 1);
+    }
+
+    return confirmed_frame;
+}
+
+// Missing input is predicted by repeating the latest input we have from that peer
+static void ulnet__input_state_for_frame(ulnet_session_t *session, int64_t frame, ulnet_input_state_t (*input_state)[ULNET_PORT_COUNT]) {
     for (int peer_idx = 0; peer_idx < SAM2_PORT_MAX+1; peer_idx++) {
         if (   session->room_we_are_in.peer_ids[peer_idx] > SAM2_PORT_SENTINELS_MAX
             || peer_idx == SAM2_AUTHORITY_INDEX
@@ -283,26 +1008,412 @@ ULNET_LINKAGE void ulnet_input_poll(ulnet_session_t *session, ulnet_input_state_
                 assert(peer_idx == SAM2_AUTHORITY_INDEX);
             }
 
-            assert(session->state[peer_idx].frame <= session->frame_counter + (ULNET_DELAY_BUFFER_SIZE-1));
-            assert(session->state[peer_idx].frame >= session->frame_counter);
+            assert(session->state[peer_idx].frame <= frame + (session->delay_buffer_size-1));
+            assert(session->state[peer_idx].frame >= frame - ulnet__rollback_frames(session));
+            int64_t peer_frame = SAM2_MIN(frame, session->state[peer_idx].frame);
             for (int i = 0; i < SAM2_ARRAY_LENGTH((*input_state)[0]); i++) {
                 #if defined(ULNET__DEBUG_EVERYONE_ON_PORT_0)
                 int port = 0;
                 #else
                 int port = peer_idx;
                 #endif
-                (*input_state)[port][i] |= session->state[peer_idx].input_state[session->frame_counter % ULNET_DELAY_BUFFER_SIZE][port][i];
+                (*input_state)[port][i] |= session->state[peer_idx].input_state[peer_frame % ULNET_DELAY_BUFFER_SIZE_MAX][port][i];
             }
         }
     }
 }
 
+static void ulnet__get_state_frame(ulnet_state_t *state, int64_t frame, ulnet_state_frame_t *state_frame) {
+    int64_t frame_index = frame % ULNET_DELAY_BUFFER_SIZE_MAX;
+    memcpy(state_frame->input_state, state->input_state[frame_index], sizeof(state_frame->input_state));
+    state_frame->room_xor_delta = state->room_xor_delta[frame_index];
+    state_frame->core_option    = state->core_option[frame_index];
+}
+
+static void ulnet__set_state_frame(ulnet_state_t *state, int64_t frame, const ulnet_state_frame_t *state_frame) {
+    int64_t frame_index = frame % ULNET_DELAY_BUFFER_SIZE_MAX;
+    memcpy(state->input_state[frame_index], state_frame->input_state, sizeof(state_frame->input_state));
+    state->room_xor_delta[frame_index] = state_frame->room_xor_delta;
+    state->core_option[frame_index]    = state_frame->core_option;
+}
+
+static void ulnet__xor_delta_state_frame(ulnet_state_t *state, int64_t frame, ulnet_state_frame_t *state_frame) {
+    int64_t frame_index = frame % ULNET_DELAY_BUFFER_SIZE_MAX;
+    ulnet__xor_delta(state_frame->input_state, state->input_state[frame_index], sizeof(state_frame->input_state));
+    ulnet__xor_delta(&state_frame->room_xor_delta, &state->room_xor_delta[frame_index], sizeof(state_frame->room_xor_delta));
+    ulnet__xor_delta(&state_frame->core_option, &state->core_option[frame_index], sizeof(state_frame->core_option));
+}
+
+// Returns the packet size or -1 if not even one frame fits
+static int64_t ulnet__encode_state_packet(ulnet_session_t *session, ulnet_state_packet_t *packet, int64_t packet_capacity) {
+    int our_port = ulnet_our_port(session);
+    ulnet_state_t *state = &session->state[our_port];
+
+    ulnet_state_packed_t packed;
+    packed.frame = state->frame;
+    memset(packed.spacing, 0, sizeof(packed.spacing));
+
+    // Deltas are taken against the newest frame every peer has. Spectators can't tell us what they have, but they
+    // get the same packets as everyone else relayed through the authority and otherwise wait for the next keyframe
+    bool keyframe = state->frame % ULNET_STATE_PACKET_KEYFRAME_INTERVAL == 0;
+    int64_t base_frame = state->frame - 1;
+    int peer_count = 0;
+    for (int p = 0; p < SAM2_PORT_MAX+1; p++) {
+        int64_t ack_frame_offset = state->frame - session->state[p].frame;
+        packed.ack_frame_offset[p] = INT8_MIN;
+        if (session->room_we_are_in.peer_ids[p] <= SAM2_PORT_SENTINELS_MAX) continue;
+        if (p == our_port) continue;
+
+        if (ack_frame_offset > INT8_MIN && ack_frame_offset <= INT8_MAX) {
+            packed.ack_frame_offset[p] = (int8_t) ack_frame_offset;
+        }
+
+        base_frame = SAM2_MIN(base_frame, session->peer_acked_frame[p]);
+        peer_count++;
+    }
+
+    // The delta base has to still be in our ring buffer. With the largest delay buffer it shares a slot with the newest frame
+    int64_t frame_count = state->frame - base_frame;
+    keyframe |= peer_count == 0 || base_frame < 0 || frame_count > session->delay_buffer_size || frame_count >= ULNET_DELAY_BUFFER_SIZE_MAX;
+    if (keyframe) {
+        frame_count = SAM2_MIN(session->delay_buffer_size, state->frame + 1);
+    }
+
+    for (;;) {
+        packed.flags = keyframe ? ULNET_STATE_PACKET_FLAG_KEYFRAME : 0;
+        for (int64_t i = 0; i < frame_count; i++) {
+            ulnet__get_state_frame(state, state->frame - i, &packed.frames[i]);
+            if (i < frame_count-1 || !keyframe) {
+                ulnet__xor_delta_state_frame(state, state->frame - i - 1, &packed.frames[i]);
+            }
+        }
+
+        int64_t coded_state_size = rle8_encode_capped(
+            (uint8_t *) &packed, sizeof(packed) - sizeof(packed.frames) + frame_count * sizeof(packed.frames[0]),
+            packet->coded_state, packet_capacity - sizeof(ulnet_state_packet_t)
+        );
+
+        if (coded_state_size >= 0) {
+            return sizeof(ulnet_state_packet_t) + coded_state_size;
+        }
+
+        // Lots of analog noise could make the frames too big to all fit so we drop the oldest ones until they do
+        if (keyframe && frame_count == 1) {
+            return -1;
+        } else if (keyframe) {
+            frame_count /= 2;
+        } else {
+            keyframe = true;
+            frame_count = SAM2_MIN(session->delay_buffer_size, state->frame + 1);
+        }
+    }
+}
+
+// Decodes just the frame number at the start of an input packet or returns -1 if there isn't one
+static int64_t ulnet__state_packet_frame(const uint8_t *coded_state, int64_t coded_state_size) {
+    int64_t frame = -1;
+    int64_t input_consumed = 0;
+    rle8_decode_extra(coded_state, coded_state_size, &input_consumed, (uint8_t *) &frame, sizeof(frame));
+    return frame;
+}
+
+// Returns the number of frames in the packet or -1 if it's malformed
+static int64_t ulnet__decode_state_packet(const uint8_t *coded_state, int64_t coded_state_size, ulnet_state_packed_t *packed) {
+    int64_t header_size = sizeof(*packed) - sizeof(packed->frames);
+    int64_t packed_size = rle8_decode(coded_state, coded_state_size, (uint8_t *) packed, sizeof(*packed));
+    if (packed_size < 0) {
+        return -1;
+    }
+
+    int64_t frame_count = (packed_size - header_size) / (int64_t) sizeof(packed->frames[0]);
+
+    if (   frame_count < 1
+        || packed_size != header_size + frame_count * (int64_t) sizeof(packed->frames[0])
+        || packed->frame - frame_count + 1 < 0) {
+        return -1;
+    }
+
+    return frame_count;
+}
+
+// Returns false if the packet is a delta against a frame we don't have
+static bool ulnet__unpack_state(const ulnet_state_packed_t *packed, int64_t frame_count, ulnet_state_t *state) {
+    bool keyframe = packed->flags & ULNET_STATE_PACKET_FLAG_KEYFRAME;
+    int64_t base_frame = packed->frame - frame_count;
+    if (   !keyframe
+        && (   base_frame > state->frame || base_frame <= state->frame - ULNET_DELAY_BUFFER_SIZE_MAX
+            || frame_count >= ULNET_DELAY_BUFFER_SIZE_MAX)) {
+        return false;
+    }
+
+    for (int64_t i = frame_count-1; i >= 0; i--) {
+        ulnet_state_frame_t state_frame = packed->frames[i];
+        if (i < frame_count-1 || !keyframe) {
+            ulnet__xor_delta_state_frame(state, packed->frame - i - 1, &state_frame);
+        }
+
+        ulnet__set_state_frame(state, packed->frame - i, &state_frame);
+    }
+
+    state->frame = packed->frame;
+    return true;
+}
+
+// History rings are only allocated for ports that are actually used so a session's footprint follows the peers in it
+static uint8_t *ulnet__state_packet_history(ulnet_session_t *session, int port, int64_t frame) {
+    if (!session->state_packet_history[port]) {
+        session->state_packet_history_size = SAM2_MAX(ULNET_DELAY_BUFFER_SIZE_MAX, session->state_packet_history_size ? session->state_packet_history_size : ULNET_STATE_PACKET_HISTORY_SIZE);
+        session->state_packet_history[port] = (uint8_t *) calloc(session->state_packet_history_size, ULNET_PACKET_SIZE_BYTES_MAX);
+        session->state_packet_history_size_bytes[port] = (uint16_t *) calloc(session->state_packet_history_size, sizeof(uint16_t));
+        assert(session->state_packet_history[port] && session->state_packet_history_size_bytes[port]);
+    }
+
+    return session->state_packet_history[port] + ((uint64_t) frame % session->state_packet_history_size) * ULNET_PACKET_SIZE_BYTES_MAX; // Unsigned since the frame can wrap past ULNET_WAITING_FOR_SAVE_STATE_SENTINEL
+}
+
+static void ulnet__store_state_packet_history(ulnet_session_t *session, int port, int64_t frame, const void *data, size_t size) {
+    assert(size <= ULNET_PACKET_SIZE_BYTES_MAX);
+    uint8_t *history_packet = ulnet__state_packet_history(session, port, frame);
+    memcpy(history_packet, data, size);
+    memset(history_packet + size, 0, ULNET_PACKET_SIZE_BYTES_MAX - size);
+    session->state_packet_history_size_bytes[port][(uint64_t) frame % session->state_packet_history_size] = (uint16_t) size;
+}
+
+static ulnet_decoded_frame_t *ulnet__decoded_frame(ulnet_session_t *session, int port, int64_t frame) {
+    if (!session->decoded_frames[port]) {
+        ulnet__state_packet_history(session, port, frame); // Fixes state_packet_history_size
+        session->decoded_frames[port] = (ulnet_decoded_frame_t *) malloc(session->state_packet_history_size * sizeof(ulnet_decoded_frame_t));
+        assert(session->decoded_frames[port]);
+        for (int64_t i = 0; i < session->state_packet_history_size; i++) {
+            session->decoded_frames[port][i].frame = -1;
+        }
+    }
+
+    return &session->decoded_frames[port][(uint64_t) frame % session->state_packet_history_size];
+}
+
+// Undoes the delta coding of an input packet into the decoded ring. Deltas chain off the frame before them which has to be in the ring already
+static void ulnet__decode_frames(ulnet_session_t *session, int port, const ulnet_state_packed_t *packed, int64_t frame_count) {
+    bool keyframe = packed->flags & ULNET_STATE_PACKET_FLAG_KEYFRAME;
+    for (int64_t i = frame_count-1; i >= 0; i--) {
+        int64_t frame = packed->frame - i;
+        ulnet_decoded_frame_t *decoded = ulnet__decoded_frame(session, port, frame);
+        if (decoded->frame > frame) return; // Older than anything the ring can hold
+
+        ulnet_state_frame_t state_frame = packed->frames[i];
+        if (i < frame_count-1 || !keyframe) {
+            ulnet_decoded_frame_t *base = ulnet__decoded_frame(session, port, frame - 1);
+            if (base->frame != frame - 1) return; // Lost the packet with the base so we wait for a keyframe
+
+            ulnet__xor_delta(&state_frame, &base->state_frame, sizeof(state_frame));
+        }
+
+        decoded->frame = frame;
+        decoded->state_frame = state_frame;
+    }
+}
+
+static inline void ulnet__reset_save_state_bookkeeping(ulnet_session_t *session) {
+    session->remote_packet_groups = FEC_PACKET_GROUPS_MAX;
+    session->remote_savestate_transfer_offset = 0;
+    session->remote_savestate_transfer_packets_received = 0;
+    free(session->remote_savestate_transfer);
+    session->remote_savestate_transfer = NULL;
+    session->remote_savestate_transfer_packets_size_bytes = 0;
+    session->remote_reed_solomon_k = 0;
+    memset(session->fec_index_counter, 0, sizeof(session->fec_index_counter));
+
+    session->remote_savestate_block_size = 0;
+    session->remote_savestate_stream_blocks = 0;
+    session->remote_savestate_stream_offset_bytes = 0;
+    session->remote_savestate_stream_failed = false;
+    session->remote_savestate_data_size_bytes = 0;
+    free(session->remote_savestate_data);
+    session->remote_savestate_data = NULL;
+    if (session->remote_savestate_dctx) {
+        ZSTD_freeDCtx(session->remote_savestate_dctx);
+        session->remote_savestate_dctx = NULL;
+    }
+    if (session->remote_savestate_xxh64_state) {
+        ZSTD_XXH64_freeState(session->remote_savestate_xxh64_state);
+        session->remote_savestate_xxh64_state = NULL;
+    }
+}
+
+// Sends the same datagram to every connected agent on ports [port_begin, port_end)
+// libjuice gives every agent its own socket so there's no single syscall for all of them (sendmmsg batches per socket), but
+// this way each agent's state is only queried once and there's one place sends are accounted for
+static int ulnet__broadcast(ulnet_session_t *session, int port_begin, int port_end, const void *data, size_t size) {
+    IMH(uint64_t start = ulnet_monotonic_nsec();)
+    int sent = 0;
+    for (int p = port_begin; p < port_end; p++) {
+        juice_agent_t *agent = session->agent[p];
+        if (!agent) continue;
+
+        juice_state_t state = juice_get_state(agent);
+        if (state != JUICE_STATE_CONNECTED && state != JUICE_STATE_COMPLETED) continue;
+
+        if (juice_send(agent, (const char *) data, size) == 0) {
+            sent++;
+        }
+    }
+
+    session->broadcast_datagrams_sent += sent;
+    IMH(session->broadcast_nsec += ulnet_monotonic_nsec() - start;)
+    return sent;
+}
+
+// MARK: Spectator relay tree
+// The authority and every spectator serve at most spectator_fanout spectators directly and redirect anyone past that to one
+// of theirs. Input fans out through the tree so each peer's egress is bounded by the fan-out instead of the audience
+
+static bool ulnet__spectator_can_relay(ulnet_session_t *session, int p) {
+    juice_agent_t *agent = session->agent[p];
+    if (!agent) return false;
+
+    juice_state_t state = juice_get_state(agent);
+    if (state != JUICE_STATE_CONNECTED && state != JUICE_STATE_COMPLETED) return false;
+
+    // They can't serve a save state until they've loaded one themselves
+    return    !(session->peer_needs_sync_bitfield & (1ULL << p))
+           && !(session->save_state_job && session->save_state_job->agent[p] == agent);
+}
+
+static void ulnet__send_relay_redirect(ulnet_session_t *session, uint64_t peer_id, uint64_t relay_peer_id) {
+    sam2_signal_message_t redirect = { SAM2_SIGN_HEADER };
+    redirect.peer_id = peer_id;
+    snprintf(redirect.ice_sdp, sizeof(redirect.ice_sdp), ULNET_RELAY_SDP_PREFIX "%016" PRIx64, relay_peer_id);
+    session->sam2_send_callback(session->user_ptr, (char *) &redirect);
+}
+
+// Returns true if the spectator was sent further down the tree instead of connecting to us
+static bool ulnet__redirect_spectator(ulnet_session_t *session, uint64_t peer_id) {
+    int64_t fanout = session->spectator_fanout ? session->spectator_fanout : ULNET_SPECTATOR_FANOUT_DEFAULT;
+    if (session->spectator_count < SAM2_MIN(fanout, ULNET_SPECTATOR_MAX)) return false;
+
+    for (int i = 0; i < session->spectator_count; i++) {
+        int s = (int) ((session->spectator_redirect_counter + i) % session->spectator_count);
+        if (!ulnet__spectator_can_relay(session, SAM2_PORT_MAX+1 + s)) continue;
+
+        SAM2_LOG_INFO("Redirecting spectator %016" PRIx64 " to relay through %016" PRIx64, peer_id, session->spectator_peer_ids[s]);
+        ulnet__send_relay_redirect(session, peer_id, session->spectator_peer_ids[s]);
+        session->spectator_redirect_counter = s + 1;
+        return true;
+    }
+
+    return false; // Nobody below us can relay yet so we take them ourselves while there's room
+}
+
+// Drops whoever we get input from and starts over through peer_id
+static void ulnet__spectate_through(ulnet_session_t *session, uint64_t peer_id) {
+    uint64_t authority_peer_id = session->room_we_are_in.peer_ids[SAM2_AUTHORITY_INDEX];
+
+    // The input we forward will have a gap we can't fill so the spectators below us have to start over from the top too
+    while (session->spectator_count) {
+        ulnet__send_relay_redirect(session, session->spectator_peer_ids[0], authority_peer_id);
+        ulnet_disconnect_peer(session, SAM2_PORT_MAX+1);
+    }
+
+    juice_agent_t *agent = session->agent[SAM2_AUTHORITY_INDEX];
+    if (agent) {
+        ulnet__save_state_job_forget_agent(session, agent);
+        juice_destroy(agent);
+        session->agent[SAM2_AUTHORITY_INDEX] = NULL;
+    }
+
+    ulnet__reset_save_state_bookkeeping(session);
+    session->peer_input_frame_seen[SAM2_AUTHORITY_INDEX] = -1;
+    session->peer_packet_loss[SAM2_AUTHORITY_INDEX] = -1.0;
+    session->frame_counter = ULNET_WAITING_FOR_SAVE_STATE_SENTINEL;
+    session->relay_parent_peer_id = peer_id == authority_peer_id ? 0 : peer_id;
+    ulnet_startup_ice_for_peer(session, peer_id, NULL);
+}
+
+static void ulnet__relay_rejoin_if_parent_failed(ulnet_session_t *session) {
+    if (   !session->relay_parent_peer_id
+        || !session->agent[SAM2_AUTHORITY_INDEX]
+        || juice_get_state(session->agent[SAM2_AUTHORITY_INDEX]) != JUICE_STATE_FAILED) {
+        return;
+    }
+
+    SAM2_LOG_WARN("Lost our relay %016" PRIx64 " rejoining through the authority", session->relay_parent_peer_id);
+    ulnet__spectate_through(session, session->room_we_are_in.peer_ids[SAM2_AUTHORITY_INDEX]);
+}
+
+// Input older than the history ring is gone so a spectator that falls that far behind can never catch up. It asks whoever
+// it gets input from for a new save state instead and keeps asking until one starts arriving
+static void ulnet__spectator_resync_if_too_far_behind(ulnet_session_t *session, int64_t current_time_usec) {
+    if (   !ulnet_is_spectator(session, session->our_peer_id)
+        || !session->agent[SAM2_AUTHORITY_INDEX]) {
+        return;
+    }
+
+    if (session->frame_counter != ULNET_WAITING_FOR_SAVE_STATE_SENTINEL) {
+        int64_t authority_frame = session->peer_input_frame_seen[SAM2_AUTHORITY_INDEX];
+        bool input_is_gone = session->decoded_frames[SAM2_AUTHORITY_INDEX]
+            && ulnet__decoded_frame(session, SAM2_AUTHORITY_INDEX, session->frame_counter)->frame > session->frame_counter;
+        if (   !input_is_gone
+            && (!session->state_packet_history_size || authority_frame - session->frame_counter < session->state_packet_history_size)) {
+            return;
+        }
+
+        SAM2_LOG_WARN("We're %" PRId64 " frames behind which is more than our input history holds; asking for a new save state",
+            authority_frame - session->frame_counter);
+        ulnet__reset_save_state_bookkeeping(session);
+        session->frame_counter = ULNET_WAITING_FOR_SAVE_STATE_SENTINEL;
+        session->flags &= ~ULNET_SESSION_FLAG_CATCHING_UP;
+        session->resync_requested_at_usec = current_time_usec - ULNET_SAVESTATE_NACK_TIMEOUT_USEC;
+    }
+
+    if (   !session->resync_requested_at_usec
+        || session->remote_savestate_transfer_packets_received > 0
+        || current_time_usec - session->resync_requested_at_usec < ULNET_SAVESTATE_NACK_TIMEOUT_USEC) {
+        return;
+    }
+
+    ulnet_save_state_feedback_packet_t request = {0};
+    request.channel_and_flags = ULNET_CHANNEL_SAVESTATE_FEEDBACK | ULNET_SAVESTATE_FEEDBACK_FLAG_RESYNC;
+    juice_send(session->agent[SAM2_AUTHORITY_INDEX], (char *) &request, sizeof(request));
+    session->resync_requested_at_usec = current_time_usec;
+}
+
+static void ulnet__relay_input_packet(ulnet_session_t *session, const char *data, size_t size) {
+    ulnet__broadcast(session, SAM2_PORT_MAX+1, SAM2_PORT_MAX+1 + session->spectator_count, data, size); // Spectators are contiguous
+}
+
+// Relays lag the input they forward so spectators we sync need the packets we already passed on for frames after our save state
+static void ulnet__relay_replay_input_history(ulnet_session_t *session, uint64_t peer_bitfield, int64_t save_state_frame) {
+    for (int port = 0; port < SAM2_PORT_MAX+1; port++) {
+        if (session->room_we_are_in.peer_ids[port] <= SAM2_PORT_SENTINELS_MAX) continue;
+        if (!session->state_packet_history[port]) continue;
+
+        for (int64_t frame = save_state_frame; frame < save_state_frame + session->state_packet_history_size; frame++) {
+            uint8_t *packet = ulnet__state_packet_history(session, port, frame);
+            if (ulnet__state_packet_frame(((ulnet_state_packet_t *) packet)->coded_state, ULNET_PACKET_SIZE_BYTES_MAX-1) != frame) continue;
+
+            // Resent at exactly the size received since trimming the padding can cut into a trailing RLE8 zero run
+            int size = session->state_packet_history_size_bytes[port][(uint64_t) frame % session->state_packet_history_size];
+            if (size == 0) continue;
+
+            for (int p = SAM2_PORT_MAX+1; p < SAM2_ARRAY_LENGTH(session->agent); p++) {
+                if ((peer_bitfield & (1ULL << p)) && session->agent[p]) {
+                    juice_send(session->agent[p], (const char *) packet, size);
+                }
+            }
+        }
+    }
+}
+
+ULNET_LINKAGE void ulnet_input_poll(ulnet_session_t *session, ulnet_input_state_t (*input_state)[ULNET_PORT_COUNT]) {
+    ulnet__input_state_for_frame(session, session->frame_counter, input_state);
+}
+
 // @todo Weird interface
 ULNET_LINKAGE ulnet_input_state_t (*ulnet_query_generate_next_input(ulnet_session_t *session, ulnet_core_option_t *next_frame_option))[ULNET_PORT_COUNT] {
     // Poll input with buffering for netplay
     if (!ulnet_is_spectator(session, session->our_peer_id) && session->state[ulnet_our_port(session)].frame < session->frame_counter + session->delay_frames) {
         // @todo The preincrement does not make sense to me here, but things have been working
-        int64_t next_buffer_index = ++session->state[ulnet_our_port(session)].frame % ULNET_DELAY_BUFFER_SIZE;
+        int64_t next_buffer_index = ++session->state[ulnet_our_port(session)].frame % ULNET_DELAY_BUFFER_SIZE_MAX;
 
         session->state[ulnet_our_port(session)].core_option[next_buffer_index] = *next_frame_option;
         memset(next_frame_option, 0, sizeof(*next_frame_option));
@@ -318,32 +1429,275 @@ ULNET_LINKAGE ulnet_input_state_t (*ulnet_query_generate_next_input(ulnet_sessio
     return NULL;
 }
 
+// MARK: Clock
+// Everything in here from frame pacing to transfer timeouts to profiling runs off one monotonic nanosecond clock
+// so the numbers are comparable and nothing jumps when the wall clock gets adjusted
 #ifdef _WIN32
-int64_t get_unix_time_microseconds() {
-    FILETIME ft;
-    GetSystemTimeAsFileTime(&ft);
+// QueryPerformanceCounter is already backed by the invariant TSC on hardware that has one
+ULNET_LINKAGE int64_t ulnet_monotonic_nsec(void) {
+    static LARGE_INTEGER frequency;
+    if (!frequency.QuadPart) {
+        QueryPerformanceFrequency(&frequency);
+    }
+
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    return counter.QuadPart / frequency.QuadPart * 1000000000 + counter.QuadPart % frequency.QuadPart * 1000000000 / frequency.QuadPart;
+}
+#else
+#include <time.h>
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#include <cpuid.h>
+#include <x86intrin.h>
+#define ULNET__TSC 1
+#endif
+
+static int64_t ulnet__monotonic_raw_nsec(void) {
+    struct timespec ts;
+#if defined(CLOCK_MONOTONIC_RAW)
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts); // Not slewed by NTP
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#if defined(ULNET__TSC)
+static struct {
+    int state; // 0 uncalibrated, 1 use the TSC, -1 the TSC isn't invariant so use the raw clock
+    uint64_t tsc_at_epoch;
+    int64_t nsec_at_epoch;
+    double nsec_per_tick;
+} ulnet__tsc_clock;
+
+// Reads both clocks at the same instant as best we can by keeping the tightest of a few TSC brackets
+static void ulnet__tsc_sample(uint64_t *tsc, int64_t *nsec) {
+    uint64_t best_bracket = UINT64_MAX;
+    for (int i = 0; i < 8; i++) {
+        uint64_t before = __rdtsc();
+        int64_t raw_nsec = ulnet__monotonic_raw_nsec();
+        uint64_t after = __rdtsc();
+        if (after - before < best_bracket) {
+            best_bracket = after - before;
+            *tsc = before + (after - before) / 2;
+            *nsec = raw_nsec;
+        }
+    }
+}
 
-    ULARGE_INTEGER ul;
-    ul.LowPart = ft.dwLowDateTime;
-    ul.HighPart = ft.dwHighDateTime;
+// Called once. Spins ~10ms measuring the TSC against the raw clock which puts the rate within a few ppm
+static void ulnet__tsc_calibrate(void) {
+    unsigned int eax, ebx, ecx, edx;
+    if (   !__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) || eax < 0x80000007
+        || !__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1 << 8))) {
+        ulnet__tsc_clock.state = -1;
+        return;
+    }
+
+    uint64_t tsc_begin, tsc_end;
+    int64_t nsec_begin, nsec_end;
+    ulnet__tsc_sample(&tsc_begin, &nsec_begin);
+    do {
+        ulnet__tsc_sample(&tsc_end, &nsec_end);
+    } while (nsec_end - nsec_begin < 10000000);
+
+    ulnet__tsc_clock.tsc_at_epoch = tsc_begin;
+    ulnet__tsc_clock.nsec_at_epoch = nsec_begin;
+    ulnet__tsc_clock.nsec_per_tick = (double) (nsec_end - nsec_begin) / (double) (tsc_end - tsc_begin);
+    ulnet__tsc_clock.state = 1;
+}
+#endif
+
+ULNET_LINKAGE int64_t ulnet_monotonic_nsec(void) {
+#if defined(ULNET__TSC)
+    if (ulnet__tsc_clock.state == 0) {
+        ulnet__tsc_calibrate();
+    }
 
-    int64_t unix_time = (int64_t)(ul.QuadPart - 116444736000000000LL) / 10;
+    if (ulnet__tsc_clock.state == 1) {
+        return ulnet__tsc_clock.nsec_at_epoch + (int64_t) ((double) (__rdtsc() - ulnet__tsc_clock.tsc_at_epoch) * ulnet__tsc_clock.nsec_per_tick);
+    }
+#endif
+    return ulnet__monotonic_raw_nsec();
+}
+#endif
 
-    return unix_time;
+ULNET_LINKAGE int64_t ulnet_monotonic_usec(void) {
+    return ulnet_monotonic_nsec() / 1000;
+}
+
+#ifdef _WIN32
+static void ulnet__sleep_until_usec(int64_t deadline_usec) {
+    // Sleep() only has millisecond granularity and we only get here for less than that so spin
+    while (ulnet_monotonic_usec() < deadline_usec) {
+        YieldProcessor();
+    }
 }
 #else
-int64_t get_unix_time_microseconds() {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+static void ulnet__sleep_until_usec(int64_t deadline_usec) {
+    // The deadline is on our clock not CLOCK_MONOTONIC so this sleeps relative and rechecks instead of using TIMER_ABSTIME
+    for (int64_t wait_usec; (wait_usec = deadline_usec - ulnet_monotonic_usec()) > 0;) {
+        struct timespec wait = { (time_t) (wait_usec / 1000000), (long) (wait_usec % 1000000 * 1000) };
+        nanosleep(&wait, NULL);
+    }
 }
 #endif
 
-double core_wants_tick_in_seconds(int64_t core_wants_tick_at_unix_usec) {
-    double seconds = (core_wants_tick_at_unix_usec - get_unix_time_microseconds()) / 1000000.0;
+double core_wants_tick_in_seconds(int64_t core_wants_tick_at_usec) {
+    double seconds = (core_wants_tick_at_usec - ulnet_monotonic_usec()) / 1000000.0;
     return seconds;
 }
 
+static void ulnet__apply_core_option(ulnet_session_t *session) {
+    ulnet_core_option_t maybe_core_option_for_this_frame = session->state[SAM2_AUTHORITY_INDEX].core_option[session->frame_counter % ULNET_DELAY_BUFFER_SIZE_MAX];
+    if (maybe_core_option_for_this_frame.key[0] != '\0') {
+        if (strcmp(maybe_core_option_for_this_frame.key, "netplay_delay_frames") == 0) {
+            session->delay_frames = atoi(maybe_core_option_for_this_frame.value);
+            session->delay_frames = SAM2_MAX(0, SAM2_MIN(session->delay_frames, ULNET_DELAY_FRAMES_MAX(session->delay_buffer_size)));
+        } else if (strcmp(maybe_core_option_for_this_frame.key, "netplay_rollback_frames") == 0) {
+            session->rollback_frames = atoi(maybe_core_option_for_this_frame.value);
+            session->rollback_frames = SAM2_MAX(0, SAM2_MIN(session->rollback_frames, ULNET_ROLLBACK_FRAMES_MAX(session->delay_buffer_size)));
+        }
+
+        for (int i = 0; i < SAM2_ARRAY_LENGTH(session->core_options); i++) {
+            if (strcmp(session->core_options[i].key, maybe_core_option_for_this_frame.key) == 0) {
+                session->core_options[i] = maybe_core_option_for_this_frame;
+                session->flags |= ULNET_SESSION_FLAG_CORE_OPTIONS_DIRTY;
+                break;
+            }
+        }
+    }
+}
+
+static void ulnet__apply_room_xor_delta(ulnet_session_t *session) {
+    sam2_room_t new_room_state = session->room_we_are_in;
+    ulnet__xor_delta(&new_room_state, &session->state[SAM2_AUTHORITY_INDEX].room_xor_delta[session->frame_counter % ULNET_DELAY_BUFFER_SIZE_MAX], sizeof(sam2_room_t));
+
+    if (memcmp(&new_room_state, &session->room_we_are_in, sizeof(sam2_room_t)) != 0) {
+        SAM2_LOG_INFO("Something about the room we're in was changed by the authority");
+
+        int64_t our_new_port = sam2_get_port_of_peer(&new_room_state, session->our_peer_id);
+        if (   sam2_get_port_of_peer(&session->room_we_are_in, session->our_peer_id) == -1
+            && our_new_port != -1) {
+            // @todo This code can be reworked to remove the above if statement as is this conditional really doesn't make sense anyway, but it shouldn't really be a problem for now
+            SAM2_LOG_INFO("We were let into the server by the authority");
+
+            // @todo This assertion is only true if the peer left on their own and is behaving nicely
+            assert(session->state[our_new_port].frame < session->frame_counter);
+            session->state[our_new_port].frame = session->frame_counter;
+
+            for (int p = 0; p < SAM2_ARRAY_LENGTH(new_room_state.peer_ids); p++) {
+                if (new_room_state.peer_ids[p] <= SAM2_PORT_SENTINELS_MAX) continue;
+                if (new_room_state.peer_ids[p] == session->our_peer_id) continue;
+                if (session->agent[p] == NULL) {
+                    SAM2_LOG_INFO("Starting Interactive-Connectivity-Establishment for peer %016" PRIx64, new_room_state.peer_ids[p]);
+                    ulnet_startup_ice_for_peer(session, new_room_state.peer_ids[p], NULL);
+                }
+            }
+        } else {
+            for (int p = 0; p < SAM2_ARRAY_LENGTH(new_room_state.peer_ids); p++) {
+                // @todo Check something other than just joins and leaves
+                if (new_room_state.peer_ids[p] != session->room_we_are_in.peer_ids[p]) {
+                    if (   session->room_we_are_in.peer_ids[p] > SAM2_PORT_SENTINELS_MAX
+                        && new_room_state.peer_ids[p] <= SAM2_PORT_SENTINELS_MAX) {
+                        if (session->room_we_are_in.peer_ids[p] == session->our_peer_id) {
+                            SAM2_LOG_INFO("We were removed from port %d", p);
+                            for (int peer_port = 0; peer_port < SAM2_PORT_MAX; peer_port++) {
+                                if (session->agent[peer_port]) {
+                                    ulnet_disconnect_peer(session, peer_port);
+                                }
+                            }
+                        } else {
+                            SAM2_LOG_INFO("Peer %" PRIx64 " has left the room", session->room_we_are_in.peer_ids[p]);
+                            if (ulnet_is_authority(session)) {
+                                ulnet_move_peer(session, p, SAM2_PORT_MAX+1 + session->spectator_count++);
+                            } else {
+                                ulnet_disconnect_peer(session, p);
+                            }
+                        }
+                    } else if (new_room_state.peer_ids[p] > SAM2_PORT_SENTINELS_MAX) {
+                        int peer_existing_port = ulnet_locate_peer(session, new_room_state.peer_ids[p]);
+                        if (peer_existing_port != -1) {
+                            SAM2_LOG_INFO("Spectator %016" PRIx64 " was promoted to peer", new_room_state.peer_ids[p]);
+                            ulnet_move_peer(session, peer_existing_port, p); // This only moves spectators to real ports right now
+                        }
+                    }
+                }
+            }
+        }
+
+        session->room_we_are_in = new_room_state;
+        if (!(session->room_we_are_in.flags & SAM2_FLAG_ROOM_IS_NETWORK_HOSTED)) {
+            SAM2_LOG_INFO("The room %016" PRIx64 ":'%s' was abandoned", session->room_we_are_in.peer_ids[SAM2_AUTHORITY_INDEX], session->room_we_are_in.name);
+            for (int peer_port = 0; peer_port < SAM2_ARRAY_LENGTH(session->agent); peer_port++) {
+                if (session->agent[peer_port]) {
+                    ulnet_disconnect_peer(session, peer_port);
+                }
+                session->room_we_are_in.peer_ids[peer_port] = SAM2_PORT_AVAILABLE;
+            }
+            ulnet_session_init_defaulted(session);
+        }
+    }
+}
+
+// Checks the input we predicted against what actually arrived and resimulates from the first frame we got wrong.
+// Anything the authority changed on a frame also forces a resimulation since that is only ever applied with confirmed input
+static void ulnet__rollback(ulnet_session_t *session, void (*retro_run)(void), bool (*retro_serialize)(void *, size_t), bool (*retro_unserialize)(const void *, size_t)) {
+    int64_t confirmed_frame = SAM2_MIN(ulnet__confirmed_frame(session), session->frame_counter);
+    int64_t frame = session->rollback_confirmed_frame;
+    for (; frame < confirmed_frame; frame++) {
+        ulnet_input_state_t input_state[ULNET_PORT_COUNT] = {0};
+        ulnet__input_state_for_frame(session, frame, &input_state);
+
+        sam2_room_t no_xor_delta = {0};
+        if (   memcmp(input_state, session->rollback_input_state[frame % ULNET_DELAY_BUFFER_SIZE_MAX], sizeof(input_state)) != 0
+            || session->state[SAM2_AUTHORITY_INDEX].core_option[frame % ULNET_DELAY_BUFFER_SIZE_MAX].key[0] != '\0'
+            || memcmp(&session->state[SAM2_AUTHORITY_INDEX].room_xor_delta[frame % ULNET_DELAY_BUFFER_SIZE_MAX], &no_xor_delta, sizeof(sam2_room_t)) != 0) {
+            break;
+        }
+    }
+
+    session->rollback_confirmed_frame = frame;
+    if (frame == confirmed_frame) {
+        return;
+    }
+
+    SAM2_LOG_DEBUG("Rolling back to frame %" PRId64 " and resimulating %" PRId64 " frames", frame, session->frame_counter - frame);
+    if (!retro_unserialize(ulnet__rollback_save_state(session, frame), session->rollback_save_state_size)) {
+        SAM2_LOG_ERROR("Failed to load the save state for frame %" PRId64 " we're now desynced", frame);
+        return;
+    }
+
+    int64_t frame_counter = session->frame_counter;
+    session->flags |= ULNET_SESSION_FLAG_RESIMULATING;
+    for (session->frame_counter = frame; session->frame_counter < frame_counter; session->frame_counter++) {
+        bool input_is_confirmed = session->frame_counter < confirmed_frame;
+        uint8_t *rollback_save_state = ulnet__rollback_save_state(session, session->frame_counter);
+
+        if (session->frame_counter != frame) {
+            retro_serialize(rollback_save_state, session->rollback_save_state_size);
+        }
+
+        if (input_is_confirmed) {
+            ulnet__apply_core_option(session);
+        }
+
+        memset(session->rollback_input_state[session->frame_counter % ULNET_DELAY_BUFFER_SIZE_MAX], 0, sizeof(session->rollback_input_state[0]));
+        ulnet__input_state_for_frame(session, session->frame_counter, &session->rollback_input_state[session->frame_counter % ULNET_DELAY_BUFFER_SIZE_MAX]);
+        retro_run();
+
+        if (input_is_confirmed) {
+            ulnet__apply_room_xor_delta(session);
+            if (!(session->room_we_are_in.flags & SAM2_FLAG_ROOM_IS_NETWORK_HOSTED)) {
+                break;
+            }
+
+            session->rollback_confirmed_frame = session->frame_counter + 1;
+        }
+    }
+    session->flags &= ~ULNET_SESSION_FLAG_RESIMULATING;
+}
+
 #define ULNET_POLL_SESSION_SAVED_STATE 0b00000001
 #define ULNET_POLL_SESSION_TICKED      0b00000010
 // This procedure always sends an input packet if the core is ready to tick. This subsumes retransmission logic and generally makes protocol logic less strict
@@ -353,43 +1707,30 @@ ULNET_LINKAGE int ulnet_poll_session(ulnet_session_t *session, bool force_save_s
     int status = 0;
 
     session->retro_unserialize = retro_unserialize; // If used this is invoked through a callback within this function call
+    if (session->delay_buffer_size == 0) {
+        session->delay_buffer_size = ULNET_DELAY_BUFFER_SIZE_DEFAULT;
+    }
+
     if (   !ulnet_is_spectator(session, session->our_peer_id) 
         && session->room_we_are_in.flags & SAM2_FLAG_ROOM_IS_NETWORK_HOSTED) {
-        uint8_t _[RLE8_ENCODE_UPPER_BOUND(ULNET_PACKET_SIZE_BYTES_MAX)];
+        uint8_t _[ULNET_PACKET_SIZE_BYTES_MAX];
         ulnet_state_packet_t *input_packet = (ulnet_state_packet_t *) _;
         input_packet->channel_and_port = ULNET_CHANNEL_INPUT | ulnet_our_port(session);
-        int64_t actual_payload_size = rle8_encode(
-            (uint8_t *)&session->state[ulnet_our_port(session)],
-            sizeof(session->state[0]),
-            input_packet->coded_state
-        );
+        int64_t input_packet_size = ulnet__encode_state_packet(session, input_packet, sizeof(_));
 
-        void *next_history_packet = &session->state_packet_history[ulnet_our_port(session)][session->state[ulnet_our_port(session)].frame % ULNET_STATE_PACKET_HISTORY_SIZE];
-        memset(next_history_packet, 0, sizeof(session->state_packet_history[0][0]));
-        memcpy(
-            next_history_packet,
-            input_packet,
-            actual_payload_size
-        );
-
-        if (sizeof(ulnet_state_packet_t) + actual_payload_size > ULNET_PACKET_SIZE_BYTES_MAX) {
+        if (input_packet_size < 0) {
             SAM2_LOG_FATAL("Input packet too large to send");
         }
 
-        for (int p = 0; p < SAM2_ARRAY_LENGTH(session->agent); p++) {
-            if (!session->agent[p]) continue;
-            juice_state_t state = juice_get_state(session->agent[p]);
+        ulnet__store_state_packet_history(session, ulnet_our_port(session), session->state[ulnet_our_port(session)].frame, input_packet, input_packet_size);
 
-            // Wait until we can send netplay messages to everyone without fail
-            if (   state == JUICE_STATE_CONNECTED || state == JUICE_STATE_COMPLETED
-                && !ulnet_is_spectator(session, session->our_peer_id)) {
-                juice_send(session->agent[p], (const char *) input_packet, sizeof(ulnet_state_packet_t) + actual_payload_size);
-                SAM2_LOG_DEBUG("Sent input packet for frame %" PRId64 " dest peer_ids[%d]=%" PRIx64,
-                    session->state[SAM2_AUTHORITY_INDEX].frame, p, session->room_we_are_in.peer_ids[p]);
-            }
-        }
+        int sent = ulnet__broadcast(session, 0, SAM2_ARRAY_LENGTH(session->agent), input_packet, input_packet_size);
+        SAM2_LOG_DEBUG("Sent input packet for frame %" PRId64 " to %d peers", session->state[ulnet_our_port(session)].frame, sent);
     }
 
+    // Input goes out first so a save state transfer never delays it
+    ulnet__save_state_job_send_packets(session, ulnet_monotonic_usec());
+
 #if defined(ULNET_IMGUI)
     { // Plot Input Packet Size vs. Frame
         // @todo The gaps in the graph can be explained by out-of-order arrival of packets I think I don't even record those to history but I should
@@ -404,13 +1745,8 @@ ULNET_LINKAGE int ulnet_poll_session(ulnet_session_t *session, bool force_save_s
                 if (session->room_we_are_in.peer_ids[p] <= SAM2_PORT_SENTINELS_MAX) continue;
                 static int input_packet_size[SAM2_PORT_MAX+1][MAX_SAMPLE_SIZE] = {0};
 
-                uint8_t *peer_packet = session->state_packet_history[p][session->frame_counter % ULNET_STATE_PACKET_HISTORY_SIZE];
-                int packet_size_bytes = 0;
-                uint16_t u16_0 = 0;
-                for (; packet_size_bytes < ULNET_PACKET_SIZE_BYTES_MAX; packet_size_bytes++) {
-                    if (memcmp(peer_packet + packet_size_bytes, &u16_0, sizeof(u16_0)) == 0) break;
-                }
-                input_packet_size[p][session->frame_counter % g_sample_size] = packet_size_bytes;
+                ulnet__state_packet_history(session, p, session->frame_counter);
+                input_packet_size[p][session->frame_counter % g_sample_size] = session->state_packet_history_size_bytes[p][(uint64_t) session->frame_counter % session->state_packet_history_size];
 
                 char label[32] = {0};
                 if (p == SAM2_AUTHORITY_INDEX) {
@@ -443,8 +1779,10 @@ ULNET_LINKAGE int ulnet_poll_session(ulnet_session_t *session, bool force_save_s
         }
     }
 
-    int timeout_milliseconds = 1e3 * core_wants_tick_in_seconds(session->core_wants_tick_at_unix_usec);
-    timeout_milliseconds = SAM2_MAX(0, timeout_milliseconds);
+    // juice_user_poll only takes whole milliseconds so we round down and sleep off the rest precisely. Otherwise we
+    // tick up to a millisecond late every frame
+    int64_t wait_usec = session->flags & ULNET_SESSION_FLAG_CATCHING_UP ? 0 : session->core_wants_tick_at_usec - ulnet_monotonic_usec();
+    int timeout_milliseconds = (int) SAM2_MAX(0, wait_usec / 1000);
 
     int ret = juice_user_poll(agent, agent_count, timeout_milliseconds);
     // This will call ulnet_receive_packet_callback in a loop
@@ -452,66 +1790,71 @@ ULNET_LINKAGE int ulnet_poll_session(ulnet_session_t *session, bool force_save_s
         SAM2_LOG_FATAL("Error polling agent (%d)\n", ret);
     }
 
-    // Reconstruct input required for next tick if we're spectating... this crashes when without sufficient history to pull from @todo
-    if (ulnet_is_spectator(session, session->our_peer_id)) {
-        for (int p = 0; p < SAM2_PORT_MAX+1; p++) {
-            if (session->room_we_are_in.peer_ids[p] <= SAM2_PORT_SENTINELS_MAX) continue;
+    wait_usec = session->core_wants_tick_at_usec - ulnet_monotonic_usec();
+    if (wait_usec > 0 && wait_usec < 1000 && !(session->flags & ULNET_SESSION_FLAG_CATCHING_UP)) {
+        ulnet__sleep_until_usec(session->core_wants_tick_at_usec);
+    }
 
-            int i;
-            for (i = ULNET_DELAY_BUFFER_SIZE-1; i >= 0; i--) {
-                int64_t frame = -1;
-                ulnet_state_packet_t *ulnet_state_packet_that_could_contain_input_for_current_frame = (ulnet_state_packet_t *) session->state_packet_history[p][(session->frame_counter + i) % ULNET_STATE_PACKET_HISTORY_SIZE];
-                rle8_decode(ulnet_state_packet_that_could_contain_input_for_current_frame->coded_state, ULNET_PACKET_SIZE_BYTES_MAX, (uint8_t *) &frame, sizeof(frame));
-                if (SAM2_ABS(frame - session->frame_counter) < ULNET_DELAY_BUFFER_SIZE) {
-                    int64_t input_consumed = 0;
-                    int64_t decode_size = rle8_decode_extra(ulnet_state_packet_that_could_contain_input_for_current_frame->coded_state, ULNET_PACKET_SIZE_BYTES_MAX,
-                        &input_consumed, (uint8_t *) &session->state[p], sizeof(session->state[p]));
+    ulnet__save_state_nack_if_stalled(session, ulnet_monotonic_usec());
+    ulnet__relay_rejoin_if_parent_failed(session);
+    ulnet__spectator_resync_if_too_far_behind(session, ulnet_monotonic_usec());
 
-//                        SAM2_LOG_DEBUG("Reconstructed input for frame %" PRId64 " from peer %" PRIx64 "consumed %" PRId64 " bytes of input to produce %" PRId64,
-//                            session->frame_counter, session->room_we_are_in.peer_ids[p], input_consumed, decode_size);
+    // Spectators pull the input for the next tick out of what they decoded on arrival
+    if (   ulnet_is_spectator(session, session->our_peer_id)
+        && session->frame_counter != ULNET_WAITING_FOR_SAVE_STATE_SENTINEL) {
+        for (int p = 0; p < SAM2_PORT_MAX+1; p++) {
+            if (session->room_we_are_in.peer_ids[p] <= SAM2_PORT_SENTINELS_MAX) continue;
+            if (!session->decoded_frames[p]) continue;
 
-                    break;
-                }
+            ulnet_decoded_frame_t *decoded = ulnet__decoded_frame(session, p, session->frame_counter);
+            if (decoded->frame == session->frame_counter) {
+                ulnet__set_state_frame(&session->state[p], session->frame_counter, &decoded->state_frame);
+                session->state[p].frame = session->frame_counter;
             }
-
-            //if (i == ULNET_DELAY_BUFFER_SIZE) {
-            //    SAM2_LOG_FATAL("Failed to reconstruct input for frame %" PRId64 " from peer %" PRIx64 "\n", session->frame_counter, session->room_we_are_in.peer_ids[p]);
-            //}
         }
     }
 
+    int64_t rollback_frames = ulnet__rollback_frames(session);
+    if (   session->frame_counter != ULNET_WAITING_FOR_SAVE_STATE_SENTINEL
+        && (rollback_frames || session->rollback_confirmed_frame < session->frame_counter)) {
+        ulnet__rollback(session, retro_run, retro_serialize, retro_unserialize);
+    } else {
+        session->rollback_confirmed_frame = session->frame_counter;
+    }
+
 IMH(ImGui::SeparatorText("Things We are Waiting on Before we can Tick");)
 IMH(if                            (session->frame_counter == ULNET_WAITING_FOR_SAVE_STATE_SENTINEL) { ImGui::Text("Waiting for savestate"); })
+IMH(if                            (session->rollback_confirmed_frame < session->frame_counter) { ImGui::Text("Predicting input for %" PRId64 " of %" PRId64 " frames", session->frame_counter - session->rollback_confirmed_frame, rollback_frames); })
     bool netplay_ready_to_tick = !(session->frame_counter == ULNET_WAITING_FOR_SAVE_STATE_SENTINEL);
     if (session->room_we_are_in.flags & SAM2_FLAG_ROOM_IS_NETWORK_HOSTED) {
         for (int p = 0; p < SAM2_PORT_MAX+1; p++) {
             if (session->room_we_are_in.peer_ids[p] <= SAM2_PORT_SENTINELS_MAX) continue;
-        IMH(if                      (session->state[p].frame <  session->frame_counter) { ImGui::Text("Input state on port %d is too old", p); })
-            netplay_ready_to_tick &= session->state[p].frame >= session->frame_counter;
-        IMH(if                      (session->state[p].frame >= session->frame_counter + ULNET_DELAY_BUFFER_SIZE) { ImGui::Text("Input state on port %d is too new (ahead by %" PRId64 " frames)", p, session->state[p].frame - (session->frame_counter + ULNET_DELAY_BUFFER_SIZE)); })
-            netplay_ready_to_tick &= session->state[p].frame <  session->frame_counter + ULNET_DELAY_BUFFER_SIZE; // This is needed for spectators only. By protocol it should always true for non-spectators unless we have a bug or someone is misbehaving
+        IMH(if                      (session->state[p].frame <  session->frame_counter - rollback_frames) { ImGui::Text("Input state on port %d is too old", p); })
+            netplay_ready_to_tick &= session->state[p].frame >= session->frame_counter - rollback_frames;
+        IMH(if                      (session->state[p].frame >= session->frame_counter + session->delay_buffer_size) { ImGui::Text("Input state on port %d is too new (ahead by %" PRId64 " frames)", p, session->state[p].frame - (session->frame_counter + session->delay_buffer_size)); })
+            netplay_ready_to_tick &= session->state[p].frame <  session->frame_counter + session->delay_buffer_size; // This is needed for spectators only. By protocol it should always true for non-spectators unless we have a bug or someone is misbehaving
         }
     }
 
-    bool ignore_frame_pacing_so_we_can_catch_up = false;
-    if (ulnet_is_spectator(session, session->our_peer_id)) {
-        int64_t authority_frame = -1;
-
-        // The number of packets we check here is reasonable, since if we miss ULNET_DELAY_BUFFER_SIZE consecutive packets our connection is irrecoverable anyway
-        for (int i = 0; i < ULNET_DELAY_BUFFER_SIZE; i++) {
-            int64_t frame = -1;
-            ulnet_state_packet_t *input_packet = (ulnet_state_packet_t *) session->state_packet_history[SAM2_AUTHORITY_INDEX][(session->frame_counter + i) % ULNET_STATE_PACKET_HISTORY_SIZE];
-            rle8_decode(input_packet->coded_state, ULNET_PACKET_SIZE_BYTES_MAX, (uint8_t *) &frame, sizeof(frame));
-            authority_frame = SAM2_MAX(authority_frame, frame);
-        }
-
+    // Lagging spectators run frames back to back without presenting them until they're back within the delay window
+    if (   ulnet_is_spectator(session, session->our_peer_id)
+        && session->frame_counter != ULNET_WAITING_FOR_SAVE_STATE_SENTINEL) {
+        int64_t authority_frame = session->peer_input_frame_seen[SAM2_AUTHORITY_INDEX]; // Our relay forwards the authority's input as is
         int64_t max_frame_tolerance_a_peer_can_be_behind = 2 * session->delay_frames - 1;
-        ignore_frame_pacing_so_we_can_catch_up = authority_frame > session->frame_counter + max_frame_tolerance_a_peer_can_be_behind;
+        if (authority_frame > session->frame_counter + max_frame_tolerance_a_peer_can_be_behind) {
+            session->flags |= ULNET_SESSION_FLAG_CATCHING_UP;
+        } else if (authority_frame <= session->frame_counter + session->delay_frames) {
+            session->flags &= ~ULNET_SESSION_FLAG_CATCHING_UP;
+        }
+    } else {
+        session->flags &= ~ULNET_SESSION_FLAG_CATCHING_UP;
     }
+IMH(if                            (session->flags & ULNET_SESSION_FLAG_CATCHING_UP) { ImGui::Text("Catching up to frame %" PRId64, session->peer_input_frame_seen[SAM2_AUTHORITY_INDEX]); })
+    bool ignore_frame_pacing_so_we_can_catch_up = session->flags & ULNET_SESSION_FLAG_CATCHING_UP;
 
     if (!(session->frame_counter == ULNET_WAITING_FOR_SAVE_STATE_SENTINEL) && !ulnet_is_spectator(session, session->our_peer_id)) {
         int64_t frames_buffered = session->state[ulnet_our_port(session)].frame - session->frame_counter + 1;
-        assert(frames_buffered <= ULNET_DELAY_BUFFER_SIZE);
+        assert(frames_buffered <= session->delay_buffer_size);
         assert(frames_buffered >= 0);
     IMH(if                      (frames_buffered <  session->delay_frames) { ImGui::Text("We have not buffered enough frames still need %" PRId64, session->delay_frames - frames_buffered); })
         netplay_ready_to_tick &= frames_buffered >= session->delay_frames;
@@ -520,38 +1863,53 @@ IMH(if                            (session->frame_counter == ULNET_WAITING_FOR_S
     IMH(ImGui::End();)
 
     if (   netplay_ready_to_tick
-        && (core_wants_tick_in_seconds(session->core_wants_tick_at_unix_usec) <= 0.0
+        && (core_wants_tick_in_seconds(session->core_wants_tick_at_usec) <= 0.0
         || ignore_frame_pacing_so_we_can_catch_up)) {
         status |= ULNET_POLL_SESSION_TICKED;
         // @todo I don't think this makes sense you should keep reasonable timing yourself if you can't the authority should just kick you
         //int64_t authority_is_on_frame = session->state[SAM2_AUTHORITY_INDEX].frame;
 
-        int64_t target_frame_time_usec = 1000000 / frame_rate - 1000; // @todo There is a leftover millisecond bias here for some reason
-        int64_t current_time_unix_usec = get_unix_time_microseconds();
-        session->core_wants_tick_at_unix_usec = SAM2_MAX(session->core_wants_tick_at_unix_usec, current_time_unix_usec - target_frame_time_usec);
-        session->core_wants_tick_at_unix_usec = SAM2_MIN(session->core_wants_tick_at_unix_usec, current_time_unix_usec + target_frame_time_usec);
-
-        ulnet_core_option_t maybe_core_option_for_this_frame = session->state[SAM2_AUTHORITY_INDEX].core_option[session->frame_counter % ULNET_DELAY_BUFFER_SIZE];
-        if (maybe_core_option_for_this_frame.key[0] != '\0') {
-            if (strcmp(maybe_core_option_for_this_frame.key, "netplay_delay_frames") == 0) {
-                session->delay_frames = atoi(maybe_core_option_for_this_frame.value);
-            }
+        int64_t target_frame_time_usec = 1000000 / frame_rate;
+        int64_t current_time_usec = ulnet_monotonic_usec();
+        session->core_wants_tick_at_usec = SAM2_MAX(session->core_wants_tick_at_usec, current_time_usec - target_frame_time_usec);
+        session->core_wants_tick_at_usec = SAM2_MIN(session->core_wants_tick_at_usec, current_time_usec + target_frame_time_usec);
 
-            for (int i = 0; i < SAM2_ARRAY_LENGTH(session->core_options); i++) {
-                if (strcmp(session->core_options[i].key, maybe_core_option_for_this_frame.key) == 0) {
-                    session->core_options[i] = maybe_core_option_for_this_frame;
-                    session->flags |= ULNET_SESSION_FLAG_CORE_OPTIONS_DIRTY;
-                    break;
-                }
-            }
+        bool input_is_confirmed = session->frame_counter < ulnet__confirmed_frame(session);
+        if (input_is_confirmed) {
+            ulnet__apply_core_option(session);
         }
 
         session->flags &= ~ULNET_SESSION_FLAG_TICKED;
         int64_t save_state_frame = session->frame_counter;
-        if (force_save_state_on_tick || session->peer_needs_sync_bitfield) {
-            IMH(uint64_t start = rdtsc();)
-            retro_serialize(save_state, save_state_size);
-            IMH(g_save_cycle_count[g_frame_cyclic_offset] = rdtsc() - start;)
+
+        // Save states on frames we predicted can't be sent to peers. With rollback we send the last one taken with confirmed input instead
+        rollback_frames = ulnet__rollback_frames(session);
+        uint8_t *rollback_save_state = NULL;
+        if (rollback_frames) {
+            int64_t rollback_save_state_count = ULNET_ROLLBACK_FRAMES_MAX(session->delay_buffer_size) + 1;
+            if (   session->rollback_save_state_size != save_state_size
+                || session->rollback_save_state_count != rollback_save_state_count) {
+                session->rollback_save_states = (uint8_t *) realloc(session->rollback_save_states, rollback_save_state_count * save_state_size);
+                session->rollback_save_state_size = save_state_size;
+                session->rollback_save_state_count = rollback_save_state_count;
+            }
+
+            rollback_save_state = ulnet__rollback_save_state(session, session->frame_counter);
+            IMH(uint64_t start = ulnet_monotonic_nsec();)
+            retro_serialize(rollback_save_state, save_state_size);
+            IMH(g_save_nsec[g_frame_cyclic_offset] = ulnet_monotonic_nsec() - start;)
+        }
+
+        // Peers that connect while a save state is already in flight wait for the next one
+        bool can_sync_peers = session->peer_needs_sync_bitfield && !session->save_state_job;
+        if (force_save_state_on_tick || can_sync_peers && !rollback_frames) {
+            if (rollback_save_state) {
+                memcpy(save_state, rollback_save_state, save_state_size);
+            } else {
+                IMH(uint64_t start = ulnet_monotonic_nsec();)
+                retro_serialize(save_state, save_state_size);
+                IMH(g_save_nsec[g_frame_cyclic_offset] = ulnet_monotonic_nsec() - start;)
+            }
             status |= ULNET_POLL_SESSION_SAVED_STATE;
 
             if (session->flags & ULNET_SESSION_FLAG_TICKED) {
@@ -560,26 +1918,38 @@ IMH(if                            (session->frame_counter == ULNET_WAITING_FOR_S
             }
         }
 
-        if (session->peer_needs_sync_bitfield) {
-            for (uint64_t p = 0; p < SAM2_ARRAY_LENGTH(session->agent); p++) {
-                if (session->peer_needs_sync_bitfield & (1ULL << p)) {
-                    ulnet_send_save_state(session, session->agent[p], save_state, save_state_size, save_state_frame);
-                    session->peer_needs_sync_bitfield &= ~(1ULL << p);
+        if (can_sync_peers) {
+            uint8_t *sync_save_state = save_state;
+            int64_t sync_save_state_frame = save_state_frame;
+            if (rollback_frames) {
+                sync_save_state = ulnet__rollback_save_state(session, session->rollback_confirmed_frame);
+                sync_save_state_frame = session->rollback_confirmed_frame;
+            }
+
+            if (ulnet_send_save_state(session, session->peer_needs_sync_bitfield, sync_save_state, save_state_size, sync_save_state_frame) == 0) {
+                if (ulnet_is_spectator(session, session->our_peer_id)) {
+                    ulnet__relay_replay_input_history(session, session->peer_needs_sync_bitfield, sync_save_state_frame);
                 }
+                session->peer_needs_sync_bitfield = 0;
             }
         }
 
+        if (rollback_frames) {
+            memset(session->rollback_input_state[session->frame_counter % ULNET_DELAY_BUFFER_SIZE_MAX], 0, sizeof(session->rollback_input_state[0]));
+            ulnet__input_state_for_frame(session, session->frame_counter, &session->rollback_input_state[session->frame_counter % ULNET_DELAY_BUFFER_SIZE_MAX]);
+        }
+
         if (!(session->flags & ULNET_SESSION_FLAG_TICKED)) {
             retro_run();
         }
 
-        session->core_wants_tick_at_unix_usec += 1000000 / frame_rate;
+        session->core_wants_tick_at_usec += 1000000 / frame_rate;
 
 #if 0
         if (ulnet_is_authority(session)) {
             for (int p = 0; p < SAM2_PORT_MAX; p++) {
                 sam2_room_t no_xor_delta = {0};
-                sam2_room_t *suggested_room_xor_delta = &session->state[p].room_xor_delta[session->frame_counter % ULNET_DELAY_BUFFER_SIZE];
+                sam2_room_t *suggested_room_xor_delta = &session->state[p].room_xor_delta[session->frame_counter % ULNET_DELAY_BUFFER_SIZE_MAX];
                 if (memcmp(suggested_room_xor_delta, &no_xor_delta, sizeof(sam2_room_t)) != 0) {
                     sam2_room_join_message_t message = { SAM2_JOIN_HEADER };
                     message.room = session->room_we_are_in;
@@ -591,88 +1961,31 @@ IMH(if                            (session->frame_counter == ULNET_WAITING_FOR_S
         }
 #endif
 
-        sam2_room_t new_room_state = session->room_we_are_in;
-        ulnet__xor_delta(&new_room_state, &session->state[SAM2_AUTHORITY_INDEX].room_xor_delta[session->frame_counter % ULNET_DELAY_BUFFER_SIZE], sizeof(sam2_room_t));
-
-        if (memcmp(&new_room_state, &session->room_we_are_in, sizeof(sam2_room_t)) != 0) {
-            SAM2_LOG_INFO("Something about the room we're in was changed by the authority");
-
-            int64_t our_new_port = sam2_get_port_of_peer(&new_room_state, session->our_peer_id);
-            if (   sam2_get_port_of_peer(&session->room_we_are_in, session->our_peer_id) == -1
-                && our_new_port != -1) {
-                // @todo This code can be reworked to remove the above if statement as is this conditional really doesn't make sense anyway, but it shouldn't really be a problem for now
-                SAM2_LOG_INFO("We were let into the server by the authority");
-
-                // @todo This assertion is only true if the peer left on their own and is behaving nicely
-                assert(session->state[our_new_port].frame < session->frame_counter);
-                session->state[our_new_port].frame = session->frame_counter;
-
-                for (int p = 0; p < SAM2_ARRAY_LENGTH(new_room_state.peer_ids); p++) {
-                    if (new_room_state.peer_ids[p] <= SAM2_PORT_SENTINELS_MAX) continue;
-                    if (new_room_state.peer_ids[p] == session->our_peer_id) continue;
-                    if (session->agent[p] == NULL) {
-                        SAM2_LOG_INFO("Starting Interactive-Connectivity-Establishment for peer %016" PRIx64, new_room_state.peer_ids[p]);
-                        ulnet_startup_ice_for_peer(session, new_room_state.peer_ids[p], NULL);
-                    }
-                }
-            } else {
-                for (int p = 0; p < SAM2_ARRAY_LENGTH(new_room_state.peer_ids); p++) {
-                    // @todo Check something other than just joins and leaves
-                    if (new_room_state.peer_ids[p] != session->room_we_are_in.peer_ids[p]) {
-                        if (   session->room_we_are_in.peer_ids[p] > SAM2_PORT_SENTINELS_MAX
-                            && new_room_state.peer_ids[p] <= SAM2_PORT_SENTINELS_MAX) {
-                            if (session->room_we_are_in.peer_ids[p] == session->our_peer_id) {
-                                SAM2_LOG_INFO("We were removed from port %d", p);
-                                for (int peer_port = 0; peer_port < SAM2_PORT_MAX; peer_port++) {
-                                    if (session->agent[peer_port]) {
-                                        ulnet_disconnect_peer(session, peer_port);
-                                    }
-                                }
-                            } else {
-                                SAM2_LOG_INFO("Peer %" PRIx64 " has left the room", session->room_we_are_in.peer_ids[p]);
-                                if (ulnet_is_authority(session)) {
-                                    ulnet_move_peer(session, p, SAM2_PORT_MAX+1 + session->spectator_count++);
-                                } else {
-                                    ulnet_disconnect_peer(session, p);
-                                }
-                            }
-                        } else if (new_room_state.peer_ids[p] > SAM2_PORT_SENTINELS_MAX) {
-                            int peer_existing_port = ulnet_locate_peer(session, new_room_state.peer_ids[p]);
-                            if (peer_existing_port != -1) {
-                                SAM2_LOG_INFO("Spectator %016" PRIx64 " was promoted to peer", new_room_state.peer_ids[p]);
-                                ulnet_move_peer(session, peer_existing_port, p); // This only moves spectators to real ports right now
-                            }
-                        }
-                    }
-                }
-            }
+        // With rollback save_state is only filled in when asked for and we're usually ticking predicted frames, but there's always
+        // a snapshot of the last frame with confirmed input. Resimulating is what confirms frames so we hash whenever that moves forward
+        int64_t desync_debug_frame = save_state_frame;
+        const uint8_t *desync_debug_save_state = save_state;
+        bool desync_debug_save_state_is_new = input_is_confirmed;
+        if (rollback_frames) {
+            desync_debug_frame = session->rollback_confirmed_frame;
+            desync_debug_save_state = ulnet__rollback_save_state(session, session->rollback_confirmed_frame);
+            desync_debug_save_state_is_new = desync_debug_frame > session->desync_debug_packet.frame;
+        }
 
-            session->room_we_are_in = new_room_state;
-            if (!(session->room_we_are_in.flags & SAM2_FLAG_ROOM_IS_NETWORK_HOSTED)) {
-                SAM2_LOG_INFO("The room %016" PRIx64 ":'%s' was abandoned", session->room_we_are_in.peer_ids[SAM2_AUTHORITY_INDEX], session->room_we_are_in.name);
-                for (int peer_port = 0; peer_port < SAM2_ARRAY_LENGTH(session->agent); peer_port++) {
-                    if (session->agent[peer_port]) {
-                        ulnet_disconnect_peer(session, peer_port);
-                    }
-                    session->room_we_are_in.peer_ids[peer_port] = SAM2_PORT_AVAILABLE;
-                }
-                ulnet_session_init_defaulted(session);
-            }
+        if (input_is_confirmed) {
+            ulnet__apply_room_xor_delta(session);
+            session->rollback_confirmed_frame = session->frame_counter + 1;
         }
 
-        if (session->room_we_are_in.flags & SAM2_FLAG_ROOM_IS_NETWORK_HOSTED) {
+        if (   desync_debug_save_state_is_new
+            && session->room_we_are_in.flags & SAM2_FLAG_ROOM_IS_NETWORK_HOSTED) {
             session->desync_debug_packet.channel_and_flags = ULNET_CHANNEL_DESYNC_DEBUG;
-            session->desync_debug_packet.frame          = save_state_frame;
-            session->desync_debug_packet.save_state_hash [save_state_frame % ULNET_DELAY_BUFFER_SIZE] = ZSTD_XXH64(save_state, save_state_size, 0);
-            //session->desync_debug_packet.input_state_hash[save_state_frame % ULNET_DELAY_BUFFER_SIZE] = ZSTD_XXH64(g_libretro_context.InputState, sizeof(g_libretro_context.InputState));
-
-            for (int p = 0; p < SAM2_ARRAY_LENGTH(session->agent); p++) {
-                if (!session->agent[p]) continue;
-                juice_state_t juice_state = juice_get_state(session->agent[p]);
-                if (   (juice_state == JUICE_STATE_CONNECTED || juice_state == JUICE_STATE_COMPLETED)
-                    && !ulnet_is_spectator(session, session->our_peer_id)) {
-                    juice_send(session->agent[p], (char *) &session->desync_debug_packet, sizeof(session->desync_debug_packet));
-                }
+            session->desync_debug_packet.frame          = desync_debug_frame;
+            session->desync_debug_packet.save_state_hash [desync_debug_frame % ULNET_DELAY_BUFFER_SIZE_MAX] = ZSTD_XXH64(desync_debug_save_state, save_state_size, 0);
+            //session->desync_debug_packet.input_state_hash[save_state_frame % ULNET_DELAY_BUFFER_SIZE_MAX] = ZSTD_XXH64(g_libretro_context.InputState, sizeof(g_libretro_context.InputState));
+
+            if (!ulnet_is_spectator(session, session->our_peer_id)) {
+                ulnet__broadcast(session, 0, SAM2_ARRAY_LENGTH(session->agent), &session->desync_debug_packet, sizeof(session->desync_debug_packet));
             }
         }
 
@@ -686,20 +1999,34 @@ IMH(if                            (session->frame_counter == ULNET_WAITING_FOR_S
 ULNET_LINKAGE void ulnet_move_peer(ulnet_session_t *session, int peer_existing_port, int peer_new_port) {
     assert(peer_new_port == -1 || peer_existing_port != peer_new_port);
     assert(peer_new_port == -1 || session->agent[peer_new_port] == NULL);
-    assert(peer_new_port == -1 || session->room_we_are_in.peer_ids[peer_new_port] <= SAM2_PORT_SENTINELS_MAX);
+    assert(peer_new_port == -1 || *ulnet__peer_id_slot(session, peer_new_port) <= SAM2_PORT_SENTINELS_MAX);
     assert(session->agent[peer_existing_port] != NULL);
 
     juice_agent_t *agent = session->agent[peer_existing_port];
-    int64_t peer_id = session->room_we_are_in.peer_ids[peer_existing_port];
+    int64_t peer_id = *ulnet__peer_id_slot(session, peer_existing_port);
+
+    double packet_loss = session->peer_packet_loss[peer_existing_port];
 
     session->agent[peer_existing_port] = NULL;
-    session->room_we_are_in.peer_ids[peer_existing_port] = 0;
+    *ulnet__peer_id_slot(session, peer_existing_port) = 0;
+    session->peer_packet_loss[peer_existing_port] = -1.0;
+    if (peer_existing_port < SAM2_PORT_MAX+1) {
+        session->peer_input_frame_seen[peer_existing_port] = -1;
+        free(session->state_packet_history[peer_existing_port]);
+        session->state_packet_history[peer_existing_port] = NULL;
+        free(session->state_packet_history_size_bytes[peer_existing_port]);
+        session->state_packet_history_size_bytes[peer_existing_port] = NULL;
+        free(session->decoded_frames[peer_existing_port]);
+        session->decoded_frames[peer_existing_port] = NULL;
+    }
 
     if (peer_new_port == -1) {
+        ulnet__save_state_job_forget_agent(session, agent);
         juice_destroy(agent);
     } else {
         session->agent[peer_new_port] = agent;
-        session->room_we_are_in.peer_ids[peer_new_port] = peer_id;
+        *ulnet__peer_id_slot(session, peer_new_port) = peer_id;
+        session->peer_packet_loss[peer_new_port] = packet_loss;
     }
 
     if (peer_existing_port > SAM2_AUTHORITY_INDEX) {
@@ -712,13 +2039,16 @@ ULNET_LINKAGE void ulnet_move_peer(ulnet_session_t *session, int peer_existing_p
         session->spectator_count--;
         session->agent[peer_existing_port] = session->agent[(SAM2_PORT_MAX+1) + session->spectator_count];
         session->agent[(SAM2_PORT_MAX+1) + session->spectator_count] = NULL;
-        session->room_we_are_in.peer_ids[peer_existing_port] = session->spectator_peer_ids[session->spectator_count];
+        session->peer_packet_loss[peer_existing_port] = session->peer_packet_loss[(SAM2_PORT_MAX+1) + session->spectator_count];
+        session->peer_packet_loss[(SAM2_PORT_MAX+1) + session->spectator_count] = -1.0;
+        *ulnet__peer_id_slot(session, peer_existing_port) = session->spectator_peer_ids[session->spectator_count];
+        session->spectator_peer_ids[session->spectator_count] = 0;
     }
 }
 
 ULNET_LINKAGE void ulnet_disconnect_peer(ulnet_session_t *session, int peer_port) {
     if (peer_port > SAM2_AUTHORITY_INDEX) {
-        SAM2_LOG_INFO("Disconnecting spectator %016" PRIx64, session->room_we_are_in.peer_ids[peer_port]);
+        SAM2_LOG_INFO("Disconnecting spectator %016" PRIx64, session->spectator_peer_ids[peer_port - (SAM2_PORT_MAX+1)]);
     } else {
         SAM2_LOG_INFO("Disconnecting Peer %016" PRIx64, session->room_we_are_in.peer_ids[peer_port]);
     }
@@ -726,12 +2056,6 @@ ULNET_LINKAGE void ulnet_disconnect_peer(ulnet_session_t *session, int peer_port
     ulnet_move_peer(session, peer_port, -1);
 }
 
-static inline void ulnet__reset_save_state_bookkeeping(ulnet_session_t *session) {
-    session->remote_packet_groups = FEC_PACKET_GROUPS_MAX;
-    session->remote_savestate_transfer_offset = 0;
-    memset(session->fec_index_counter, 0, sizeof(session->fec_index_counter));
-}
-
 ULNET_LINKAGE void ulnet_session_init_defaulted(ulnet_session_t *session) {
     assert(session->spectator_count == 0);
     for (int i = 0; i < SAM2_PORT_MAX+1; i++) {
@@ -739,11 +2063,32 @@ ULNET_LINKAGE void ulnet_session_init_defaulted(ulnet_session_t *session) {
     }
 
     memset(&session->state, 0, sizeof(session->state));
-    memset(&session->state_packet_history, 0, sizeof(session->state_packet_history));
+    for (int i = 0; i < SAM2_PORT_MAX+1; i++) {
+        free(session->state_packet_history[i]);
+        session->state_packet_history[i] = NULL;
+        free(session->state_packet_history_size_bytes[i]);
+        session->state_packet_history_size_bytes[i] = NULL;
+        free(session->decoded_frames[i]);
+        session->decoded_frames[i] = NULL;
+    }
+    for (int i = 0; i < SAM2_PORT_MAX+1; i++) {
+        session->peer_acked_frame[i] = -1;
+        session->peer_input_frame_seen[i] = -1;
+    }
+
+    for (int i = 0; i < SAM2_ARRAY_LENGTH(session->peer_packet_loss); i++) {
+        session->peer_packet_loss[i] = -1.0;
+    }
 
     session->frame_counter = 0;
+    session->rollback_confirmed_frame = 0;
     session->room_we_are_in.peer_ids[SAM2_AUTHORITY_INDEX] = session->our_peer_id;
 
+    session->relay_parent_peer_id = 0;
+    session->spectator_redirect_counter = 0;
+    session->resync_requested_at_usec = 0;
+
+    ulnet__save_state_job_free(session); // A transfer to the room we left would keep going otherwise
     ulnet__reset_save_state_bookkeeping(session);
 }
 
@@ -755,12 +2100,13 @@ static void ulnet__on_state_changed(juice_agent_t *agent, juice_state_t state, v
     SAM2_LOCATE(session->agent, agent, p);
 
     if (   state == JUICE_STATE_CONNECTED
-        && session->our_peer_id == session->room_we_are_in.peer_ids[SAM2_AUTHORITY_INDEX]) {
+        && (   session->our_peer_id == session->room_we_are_in.peer_ids[SAM2_AUTHORITY_INDEX]
+            || p >= SAM2_PORT_MAX+1 && ulnet_is_spectator(session, session->our_peer_id))) { // Relays sync the spectators below them
         SAM2_LOG_INFO("Setting peer needs sync bit for peer %016" PRIx64, session->our_peer_id);
         session->peer_needs_sync_bitfield |= (1ULL << p);
     } else if (state == JUICE_STATE_FAILED) {
         if (p >= SAM2_PORT_MAX+1) {
-            SAM2_LOG_INFO("Spectator %016" PRIx64 " left" , session->room_we_are_in.peer_ids[p]);
+            SAM2_LOG_INFO("Spectator %016" PRIx64 " left" , session->spectator_peer_ids[p - (SAM2_PORT_MAX+1)]);
             ulnet_disconnect_peer(session, p);
         } else {
 
@@ -782,7 +2128,7 @@ static void ulnet__on_candidate(juice_agent_t *agent, const char *sdp, void *use
 
     sam2_signal_message_t response = { SAM2_SIGN_HEADER };
 
-    response.peer_id = session->room_we_are_in.peer_ids[p];
+    response.peer_id = ulnet__peer_id_of_port(session, p);
     if (strlen(sdp) < sizeof(response.ice_sdp)) {
         strcpy(response.ice_sdp, sdp);
         session->sam2_send_callback(session->user_ptr, (char *) &response);
@@ -805,10 +2151,177 @@ static void ulnet__on_gathering_done(juice_agent_t *agent, void *user_ptr) {
 
     sam2_signal_message_t response = { SAM2_SIGN_HEADER };
 
-    response.peer_id = session->room_we_are_in.peer_ids[p];
+    response.peer_id = ulnet__peer_id_of_port(session, p);
     session->sam2_send_callback(session->user_ptr, (char *) &response);
 }
 
+static void ulnet__send_save_state_feedback(ulnet_session_t *session, juice_agent_t *agent, uint8_t flags, uint8_t sequence_hi, uint8_t sequence_lo) {
+    ulnet_save_state_feedback_packet_t feedback = {0};
+    feedback.channel_and_flags = ULNET_CHANNEL_SAVESTATE_FEEDBACK | flags;
+    feedback.sequence_hi = sequence_hi;
+    feedback.sequence_lo = sequence_lo;
+    feedback.packets_received = session->remote_savestate_transfer_packets_received;
+
+    juice_send(agent, (char *) &feedback, sizeof(feedback));
+}
+
+static inline bool ulnet__save_state_stream_done(ulnet_session_t *session) {
+    savestate_transfer_payload_t header;
+    memcpy(&header, session->remote_savestate_header, sizeof(header)); // Strict-aliasing
+    return session->remote_savestate_stream_offset_bytes >= (int64_t) sizeof(savestate_transfer_payload_t)
+        && session->remote_savestate_stream_offset_bytes == header.total_size_bytes;
+}
+
+static void ulnet__save_state_stream_consume(ulnet_session_t *session, const uint8_t *data, int64_t size) {
+    savestate_transfer_payload_t header_storage;
+    savestate_transfer_payload_t *header = &header_storage;
+    int64_t header_size = sizeof(savestate_transfer_payload_t);
+
+    if (session->remote_savestate_stream_offset_bytes < header_size) {
+        int64_t header_bytes = SAM2_MIN(size, header_size - session->remote_savestate_stream_offset_bytes);
+        memcpy(session->remote_savestate_header + session->remote_savestate_stream_offset_bytes, data, header_bytes);
+        session->remote_savestate_stream_offset_bytes += header_bytes;
+        data += header_bytes;
+        size -= header_bytes;
+
+        if (session->remote_savestate_stream_offset_bytes < header_size) return;
+    }
+
+    memcpy(header, session->remote_savestate_header, sizeof(*header)); // Strict-aliasing
+
+    if (session->remote_savestate_stream_offset_bytes == header_size && !session->remote_savestate_xxh64_state) {
+        if (   header->compressed_savestate_size < 0
+            || header->compressed_options_size < 0
+            || header->compressed_options_size > (int64_t) sizeof(session->remote_savestate_transfer->compressed_options)
+            || header->decompressed_savestate_size < 0
+            || header->total_size_bytes != header_size + header->compressed_savestate_size + header->compressed_options_size
+            || header->total_size_bytes > (int64_t) session->remote_reed_solomon_k * session->remote_savestate_block_size * session->remote_packet_groups) {
+            SAM2_LOG_ERROR("Savestate transfer payload has bad sizes total: %" PRId64 " compressed: %" PRId64 " options: %" PRId64 "",
+                header->total_size_bytes, header->compressed_savestate_size, header->compressed_options_size);
+            session->remote_savestate_stream_failed = true;
+            return;
+        }
+
+        SAM2_LOG_INFO("Receiving savestate transfer payload for frame %" PRId64 "", header->frame_counter);
+
+        savestate_transfer_payload_t header_as_hashed = *header;
+        header_as_hashed.xxhash = 0;
+        session->remote_savestate_xxh64_state = ZSTD_XXH64_createState();
+        ZSTD_XXH64_reset(session->remote_savestate_xxh64_state, 0);
+        ZSTD_XXH64_update(session->remote_savestate_xxh64_state, &header_as_hashed, header_size);
+
+        session->remote_savestate_dctx = ZSTD_createDCtx();
+        session->remote_savestate_data = (unsigned char *) malloc(SAM2_MAX(1, header->decompressed_savestate_size));
+        if (!session->remote_savestate_dctx || !session->remote_savestate_data) {
+            SAM2_LOG_ERROR("Failed to allocate %" PRId64 " bytes to decompress savestate into", header->decompressed_savestate_size);
+            session->remote_savestate_stream_failed = true;
+            return;
+        }
+    }
+
+    size = SAM2_MIN(size, header->total_size_bytes - session->remote_savestate_stream_offset_bytes); // The last blocks are padded
+    if (size <= 0) return;
+
+    ZSTD_XXH64_update(session->remote_savestate_xxh64_state, data, size);
+
+    int64_t savestate_end = header_size + header->compressed_savestate_size;
+    if (session->remote_savestate_stream_offset_bytes < savestate_end) {
+        ZSTD_inBuffer in = { data, (size_t) SAM2_MIN(size, savestate_end - session->remote_savestate_stream_offset_bytes), 0 };
+        ZSTD_outBuffer out = { session->remote_savestate_data, (size_t) header->decompressed_savestate_size, (size_t) session->remote_savestate_data_size_bytes };
+
+        while (in.pos < in.size) {
+            size_t in_pos = in.pos, out_pos = out.pos;
+            size_t ret = ZSTD_decompressStream(session->remote_savestate_dctx, &out, &in);
+
+            if (ZSTD_isError(ret)) {
+                SAM2_LOG_ERROR("Error decompressing savestate: %s", ZSTD_getErrorName(ret));
+                session->remote_savestate_stream_failed = true;
+                return;
+            }
+
+            if (in.pos == in_pos && out.pos == out_pos) {
+                SAM2_LOG_ERROR("Savestate decompresses to more than the %" PRId64 " bytes it claimed", header->decompressed_savestate_size);
+                session->remote_savestate_stream_failed = true;
+                return;
+            }
+        }
+
+        session->remote_savestate_data_size_bytes = out.pos;
+        session->remote_savestate_stream_offset_bytes += in.size;
+        data += in.size;
+        size -= in.size;
+    }
+
+    // The options are tiny so we just hold onto them until we know the hash is good
+    memcpy(session->remote_savestate_transfer->compressed_options + (session->remote_savestate_stream_offset_bytes - savestate_end), data, size);
+    session->remote_savestate_stream_offset_bytes += size;
+}
+
+// Blocks are consumed in the order they're laid out in the payload which is also the order the authority sends the original data blocks in.
+// So unless something is lost we hash and decompress each one right as it arrives and a lost block only holds things up until its group decodes
+static void ulnet__save_state_stream_advance(ulnet_session_t *session) {
+    while (!session->remote_savestate_stream_failed && !ulnet__save_state_stream_done(session)) {
+        int i = (int) (session->remote_savestate_stream_blocks / session->remote_packet_groups);
+        int j = (int) (session->remote_savestate_stream_blocks % session->remote_packet_groups);
+
+        if (i >= session->remote_reed_solomon_k) {
+            SAM2_LOG_ERROR("Savestate transfer payload ended before we got all of it");
+            session->remote_savestate_stream_failed = true;
+        } else if (session->remote_savestate_transfer->block[j][i]) {
+            ulnet__save_state_stream_consume(session, session->remote_savestate_transfer->block[j][i], session->remote_savestate_block_size);
+            session->remote_savestate_stream_blocks++;
+        } else {
+            break;
+        }
+    }
+}
+
+static void ulnet__save_state_stream_finish(ulnet_session_t *session, juice_agent_t *agent, uint8_t sequence_hi, uint8_t sequence_lo) {
+    savestate_transfer_payload_t header_storage;
+    savestate_transfer_payload_t *header = &header_storage;
+    memcpy(header, session->remote_savestate_header, sizeof(*header)); // Strict-aliasing
+    uint64_t our_savestate_transfer_payload_xxhash = ZSTD_XXH64_digest(session->remote_savestate_xxh64_state);
+
+    if (header->xxhash != our_savestate_transfer_payload_xxhash) {
+        SAM2_LOG_ERROR("Savestate transfer payload hash mismatch: %" PRIx64 " != %" PRIx64 "", header->xxhash, our_savestate_transfer_payload_xxhash);
+        return;
+    }
+
+    if (session->remote_savestate_data_size_bytes != header->decompressed_savestate_size) {
+        SAM2_LOG_ERROR("Savestate decompressed to %" PRId64 " bytes instead of %" PRId64 "", session->remote_savestate_data_size_bytes, header->decompressed_savestate_size);
+        return;
+    }
+
+    size_t ret = ZSTD_decompress(
+        session->core_options, sizeof(session->core_options),
+        session->remote_savestate_transfer->compressed_options,
+        header->compressed_options_size
+    );
+
+    if (ZSTD_isError(ret)) {
+        SAM2_LOG_ERROR("Error decompressing core options: %s", ZSTD_getErrorName(ret));
+        return;
+    }
+
+    session->flags |= ULNET_SESSION_FLAG_CORE_OPTIONS_DIRTY;
+    //session.retro_run(); // Apply options before loading savestate; Lets hope this isn't necessary
+
+    if (!session->retro_unserialize(session->remote_savestate_data, session->remote_savestate_data_size_bytes)) {
+        SAM2_LOG_ERROR("Failed to load savestate");
+        return;
+    }
+
+    SAM2_LOG_DEBUG("Save state loaded");
+    ulnet__send_save_state_feedback(session, agent, ULNET_SAVESTATE_FEEDBACK_FLAG_DONE, sequence_hi, sequence_lo);
+    session->frame_counter = header->frame_counter;
+    session->resync_requested_at_usec = 0;
+    session->room_we_are_in = header->room;
+    session->rollback_confirmed_frame = session->frame_counter;
+    session->delay_buffer_size = SAM2_MAX(2, SAM2_MIN(header->delay_buffer_size, ULNET_DELAY_BUFFER_SIZE_MAX));
+    session->delay_frames = SAM2_MAX(0, SAM2_MIN(header->delay_frames, ULNET_DELAY_FRAMES_MAX(session->delay_buffer_size)));
+    session->rollback_frames = header->rollback_frames;
+}
+
 static void ulnet_receive_packet_callback(juice_agent_t *agent, const char *data, size_t size, void *user_ptr) {
     ulnet_session_t *session = (ulnet_session_t *) user_ptr;
 
@@ -825,7 +2338,8 @@ static void ulnet_receive_packet_callback(juice_agent_t *agent, const char *data
         return;
     }
 
-    if (p >= SAM2_PORT_MAX+1) {
+    if (   p >= SAM2_PORT_MAX+1
+        && (data[0] & ULNET_CHANNEL_MASK) != ULNET_CHANNEL_SAVESTATE_FEEDBACK) {
         SAM2_LOG_WARN("A spectator sent us a UDP packet for unsupported channel %" PRIx8 " for some reason", data[0] & ULNET_CHANNEL_MASK);
         return;
     }
@@ -852,52 +2366,97 @@ static void ulnet_receive_packet_callback(juice_agent_t *agent, const char *data
             break;
         }
 
-        if (rle8_decode_size(input_packet->coded_state, size - 1) != sizeof(ulnet_state_t)) {
+        if (   p == SAM2_AUTHORITY_INDEX
+            && ulnet_is_spectator(session, session->our_peer_id)) {
+            // Relays pass on everything even while waiting on a save state and leave the filtering to the spectators below them
+            ulnet__relay_input_packet(session, data, size);
+        }
+
+        ulnet_state_packed_t packed;
+        int64_t frame_count = ulnet__decode_state_packet(input_packet->coded_state, size - 1, &packed);
+        if (frame_count < 0) {
             SAM2_LOG_WARN("Received input packet with an invalid decode size");
             break;
         }
 
-        int64_t frame;
-        rle8_decode(input_packet->coded_state, size - 1, (uint8_t *) &frame, sizeof(frame));
+        int64_t frame = packed.frame;
+
+        // Peers send at least one input packet per frame so gaps in the frames we see directly from them are lost packets
+        if (   p == original_sender_port
+            && frame > session->peer_input_frame_seen[p]) {
+            if (session->peer_input_frame_seen[p] >= 0) {
+                int64_t frames_skipped = SAM2_MIN(frame - session->peer_input_frame_seen[p], 64);
+                double loss = (double) (frames_skipped - 1) / frames_skipped;
+                if (session->peer_packet_loss[p] < 0.0) {
+                    session->peer_packet_loss[p] = loss;
+                } else {
+                    session->peer_packet_loss[p] += (loss - session->peer_packet_loss[p]) / 64;
+                }
+            }
+
+            session->peer_input_frame_seen[p] = frame;
+        }
+
+        if (   frame >= session->state[original_sender_port].frame
+            && !ulnet_is_spectator(session, session->our_peer_id)) {
+            int8_t ack_frame_offset = packed.ack_frame_offset[ulnet_our_port(session)];
+            session->peer_acked_frame[original_sender_port] = ack_frame_offset == INT8_MIN ? -1 : frame - ack_frame_offset;
+        }
 
         SAM2_LOG_DEBUG("Recv input packet for frame %" PRId64 " from peer_ids[%d]=%" PRIx64 "",
             frame, original_sender_port, session->room_we_are_in.peer_ids[original_sender_port]);
 
-        if (frame < session->state[original_sender_port].frame) {
+        if (ulnet_is_spectator(session, session->our_peer_id)) {
+            // The save state we were sent can be many frames old by the time it's done transferring so we hang onto everything to be able to catch up
+            // The raw packets are kept too since relays replay them to the spectators they sync
+            ulnet__decode_frames(session, original_sender_port, &packed, frame_count);
+            ulnet__store_state_packet_history(session, original_sender_port, frame, data, size);
+        } else if (frame < session->state[original_sender_port].frame) {
             // UDP packets can arrive out of order this is normal
             SAM2_LOG_DEBUG("Received outdated input packet for frame %" PRId64 ". We are already on frame %" PRId64 ". Dropping it",
                 frame, session->state[original_sender_port].frame);
+        } else if (frame - frame_count > SAM2_MAX(session->state[original_sender_port].frame, session->rollback_confirmed_frame - 1)) {
+            // Only possible if the sender had to drop frames to fit the packet and some earlier packets were lost
+            SAM2_LOG_DEBUG("Received input packet for frame %" PRId64 " that doesn't reach back to the input we're missing. Dropping it", frame);
+        } else if (!ulnet__unpack_state(&packed, frame_count, &session->state[original_sender_port])) {
+            SAM2_LOG_DEBUG("Received input packet for frame %" PRId64 " that is a delta against frame %" PRId64 " which we don't have. Waiting for a keyframe",
+                frame, frame - frame_count);
         } else {
-            rle8_decode(
-                input_packet->coded_state, size - 1,
-                (uint8_t *) &session->state[original_sender_port], sizeof(ulnet_state_t)
-            );
+            ulnet__store_state_packet_history(session, original_sender_port, frame, data, size);
 
-            // Store the input packet in the history buffer. Arbitrary zero runs decode to no bytes conveniently so we don't need to store the packet size
-            int i = 0;
-            for (; i < size; i++) {
-                session->state_packet_history[original_sender_port][frame % ULNET_STATE_PACKET_HISTORY_SIZE][i] = data[i];
+            // Broadcast the input packet to spectators
+            if (ulnet_is_authority(session)) {
+                ulnet__relay_input_packet(session, data, size);
             }
+        }
 
-            for (; i < SAM2_ARRAY_LENGTH(session->state_packet_history[0][0]); i++) {
-                session->state_packet_history[original_sender_port][frame % ULNET_STATE_PACKET_HISTORY_SIZE][i] = 0;
-            }
+        break;
+    }
+    case ULNET_CHANNEL_SAVESTATE_FEEDBACK: {
+        if (   (channel_and_flags & ULNET_FLAGS_MASK) == ULNET_SAVESTATE_FEEDBACK_FLAG_NACK
+            && size == sizeof(ulnet_save_state_nack_packet_t)) {
+            ulnet_save_state_nack_packet_t nack;
+            memcpy(&nack, data, sizeof(nack));
+            ulnet__save_state_job_on_nack(session, p, &nack, ulnet_monotonic_usec());
+            break;
+        }
 
-            // Broadcast the input packet to spectators
-            if (ulnet_is_authority(session)) {
-                for (i = 0; i < ULNET_SPECTATOR_MAX; i++) {
-                    juice_agent_t *spectator_agent = session->agent[SAM2_PORT_MAX+1 + i];
-                    if (spectator_agent) {
-                        if (   juice_get_state(spectator_agent) == JUICE_STATE_CONNECTED
-                            || juice_get_state(spectator_agent) == JUICE_STATE_COMPLETED) {
-                            int status = juice_send(spectator_agent, data, size);
-                            assert(status == 0);
-                        }
-                    }
-                }
+        if (size != sizeof(ulnet_save_state_feedback_packet_t)) {
+            SAM2_LOG_WARN("Received save state feedback packet with the wrong size %zu", size);
+            break;
+        }
+
+        ulnet_save_state_feedback_packet_t feedback;
+        memcpy(&feedback, data, sizeof(feedback)); // Strict-aliasing
+        if (feedback.channel_and_flags & ULNET_SAVESTATE_FEEDBACK_FLAG_RESYNC) {
+            if (p > SAM2_AUTHORITY_INDEX && !(session->peer_needs_sync_bitfield & (1ULL << p))) {
+                SAM2_LOG_INFO("Spectator %016" PRIx64 " fell too far behind; sending them a new save state", session->spectator_peer_ids[p - (SAM2_PORT_MAX+1)]);
+                session->peer_needs_sync_bitfield |= 1ULL << p;
             }
+            break;
         }
 
+        ulnet__save_state_job_on_feedback(session, p, &feedback, ulnet_monotonic_usec());
         break;
     }
     case ULNET_CHANNEL_DESYNC_DEBUG: {
@@ -911,10 +2470,11 @@ static void ulnet_receive_packet_callback(juice_agent_t *agent, const char *data
 
         int64_t latest_common_frame = SAM2_MIN(our_desync_debug_packet.frame, their_desync_debug_packet.frame);
         int64_t frame_difference = SAM2_ABS(our_desync_debug_packet.frame - their_desync_debug_packet.frame);
-        int64_t total_frames_to_compare = ULNET_DELAY_BUFFER_SIZE - frame_difference;
+        int64_t total_frames_to_compare = ULNET_DELAY_BUFFER_SIZE_MAX - frame_difference;
         for (int f = total_frames_to_compare-1; f >= 0 ; f--) {
             int64_t frame_to_compare = latest_common_frame - f;
-            int64_t frame_index = frame_to_compare % ULNET_DELAY_BUFFER_SIZE;
+            if (frame_to_compare < 0) continue; // Nothing was hashed before the first frame
+            int64_t frame_index = frame_to_compare % ULNET_DELAY_BUFFER_SIZE_MAX;
 
             if (our_desync_debug_packet.input_state_hash[frame_index] != their_desync_debug_packet.input_state_hash[frame_index]) {
                 SAM2_LOG_ERROR("Input state hash mismatch for frame %" PRId64 " Our hash: %" PRIx64 " Their hash: %" PRIx64 "", 
@@ -962,130 +2522,109 @@ static void ulnet_receive_packet_callback(juice_agent_t *agent, const char *data
         ulnet_save_state_packet_header_t savestate_transfer_header;
         memcpy(&savestate_transfer_header, data, sizeof(ulnet_save_state_packet_header_t)); // Strict-aliasing
 
-        uint8_t sequence_hi = 0;
-        int k = 239;
-        if (channel_and_flags & ULNET_SAVESTATE_TRANSFER_FLAG_K_IS_239) {
-            if (channel_and_flags & ULNET_SAVESTATE_TRANSFER_FLAG_SEQUENCE_HI_IS_0) {
-                session->remote_packet_groups = savestate_transfer_header.packet_groups;
-            } else {
-                sequence_hi = savestate_transfer_header.sequence_hi;
+        uint8_t sequence_hi = savestate_transfer_header.sequence_hi;
+        uint8_t sequence_lo = savestate_transfer_header.sequence_lo;
+        int k = savestate_transfer_header.reed_solomon_k;
+        int n = savestate_transfer_header.reed_solomon_n;
+
+        if (   savestate_transfer_header.packet_groups == 0
+            || savestate_transfer_header.packet_groups > FEC_PACKET_GROUPS_MAX
+            || sequence_hi >= savestate_transfer_header.packet_groups) {
+            SAM2_LOG_WARN("Received savestate transfer packet with bad packet group %hhu of %hhu", sequence_hi, savestate_transfer_header.packet_groups);
+            break;
+        }
+
+        if (k == 0 || n < k || n > GF_SIZE || sequence_lo >= n) {
+            SAM2_LOG_WARN("Received savestate transfer packet with bad Reed-Solomon parameters k: %d n: %d sequence_lo: %hhu", k, n, sequence_lo);
+            break;
+        }
+
+        int block_size = (int) (size - sizeof(ulnet_save_state_packet_header_t));
+        if (   session->remote_savestate_transfer_packets_received > 0
+            && (   session->remote_packet_groups != savestate_transfer_header.packet_groups
+                || session->remote_reed_solomon_k != k
+                || session->remote_savestate_block_size != block_size)) {
+            SAM2_LOG_WARN("Received savestate transfer packet that doesn't match the transfer in progress; starting over");
+            ulnet__reset_save_state_bookkeeping(session);
+        }
+
+        if (session->remote_savestate_transfer_packets_received == 0) {
+            // We never keep more than k packets for each packet group so this is all the space the transfer can need
+            int64_t packets_size_bytes = (int64_t) savestate_transfer_header.packet_groups * k * size;
+            session->remote_savestate_transfer = (ulnet_save_state_receive_t *) malloc(sizeof(ulnet_save_state_receive_t) + packets_size_bytes);
+            if (!session->remote_savestate_transfer) {
+                SAM2_LOG_ERROR("Failed to allocate %" PRId64 " bytes for savestate transfer", packets_size_bytes);
+                break;
             }
-        } else {
-            k = savestate_transfer_header.reed_solomon_k;
-            session->remote_packet_groups = 1; // k != 239 => 1 packet group
+
+            memset(session->remote_savestate_transfer->block, 0, sizeof(session->remote_savestate_transfer->block));
+            session->remote_savestate_transfer_packets_size_bytes = packets_size_bytes;
         }
 
-        if (session->fec_index_counter[sequence_hi] == k) {
+        session->remote_packet_groups = savestate_transfer_header.packet_groups;
+        session->remote_reed_solomon_k = k;
+        session->remote_savestate_block_size = block_size;
+        session->remote_savestate_transfer_packet_at_usec = ulnet_monotonic_usec();
+
+        if (++session->remote_savestate_transfer_packets_received % ULNET_SAVESTATE_FEEDBACK_INTERVAL == 0) {
+            ulnet__send_save_state_feedback(session, agent, 0, sequence_hi, sequence_lo);
+        }
+
+        if (session->fec_index_counter[sequence_hi] >= k) {
             // We already have received enough Reed-Solomon blocks to decode the payload; we can ignore this packet
             break;
         }
 
-        if (sequence_hi >= FEC_PACKET_GROUPS_MAX) {
-            SAM2_LOG_WARN("Received savestate transfer packet with sequence_hi >= FEC_PACKET_GROUPS_MAX");
-            break;
+        bool duplicate = false; // Blocks get resent when answering a NACK
+        for (int i = 0; i < session->fec_index_counter[sequence_hi]; i++) {
+            duplicate |= session->remote_savestate_transfer->fec_index[sequence_hi][i] == sequence_lo;
         }
 
-        uint8_t sequence_lo = savestate_transfer_header.sequence_lo;
+        if (duplicate) {
+            break;
+        }
 
         SAM2_LOG_DEBUG("Received savestate packet sequence_hi: %hhu sequence_lo: %hhu", sequence_hi, sequence_lo);
 
-        uint8_t *copied_packet_ptr = (uint8_t *) memcpy(&session->remote_savestate_transfer_packets[session->remote_savestate_transfer_offset], data, size);
+        if (session->remote_savestate_transfer_offset + (int64_t) size > session->remote_savestate_transfer_packets_size_bytes) {
+            SAM2_LOG_ERROR("Savestate transfer is larger than we can hold");
+            break;
+        }
+
+        uint8_t *copied_packet_ptr = (uint8_t *) memcpy(&session->remote_savestate_transfer->packets[session->remote_savestate_transfer_offset], data, size);
         session->remote_savestate_transfer_offset += size;
 
-        session->fec_packet[sequence_hi][session->fec_index_counter[sequence_hi]] = copied_packet_ptr + sizeof(ulnet_save_state_packet_header_t);
-        session->fec_index [sequence_hi][session->fec_index_counter[sequence_hi]++] = sequence_lo;
+        ulnet_save_state_receive_t *transfer = session->remote_savestate_transfer;
+        transfer->fec_packet[sequence_hi][session->fec_index_counter[sequence_hi]] = copied_packet_ptr + sizeof(ulnet_save_state_packet_header_t);
+        transfer->fec_index [sequence_hi][session->fec_index_counter[sequence_hi]++] = sequence_lo;
+
+        if (sequence_lo < k) {
+            transfer->block[sequence_hi][sequence_lo] = copied_packet_ptr + sizeof(ulnet_save_state_packet_header_t);
+        }
 
         if (session->fec_index_counter[sequence_hi] == k) {
             SAM2_LOG_DEBUG("Received all the savestate data for packet group: %hhu", sequence_hi);
 
-            int redudant_blocks_sent = k * FEC_REDUNDANT_BLOCKS / (GF_SIZE - FEC_REDUNDANT_BLOCKS);
-            void *rs_code = fec_new(k, k + redudant_blocks_sent);
-            int rs_block_size = (int) (size - sizeof(ulnet_save_state_packet_header_t));
-            int status = fec_decode(rs_code, session->fec_packet[sequence_hi], session->fec_index[sequence_hi], rs_block_size);
+            void *rs_code = fec_new(k, GF_SIZE); // Blocks sent to answer a NACK can have any index. Rows of the code don't depend on n
+            void **packets[1] = { transfer->fec_packet[sequence_hi] };
+            int *indices[1] = { transfer->fec_index[sequence_hi] };
+            int status = fec_decode_batch(rs_code, packets, indices, 1, block_size); // Split by byte range across fec.c's thread pool
             assert(status == 0);
             fec_free(rs_code);
 
-            bool all_data_decoded = true;
-            for (int i = 0; i < session->remote_packet_groups; i++) {
-                all_data_decoded &= session->fec_index_counter[i] >= k;
+            // Decoding leaves the original data blocks in order at the front
+            for (int i = 0; i < k; i++) {
+                transfer->block[sequence_hi][i] = (uint8_t *) transfer->fec_packet[sequence_hi][i];
             }
+        }
 
-            if (all_data_decoded) {
-                size_t ret = 0;
-                uint64_t their_savestate_transfer_payload_xxhash = 0;
-                uint64_t   our_savestate_transfer_payload_xxhash = 0;
-                unsigned char *save_state_data = NULL;
-                savestate_transfer_payload_t *savestate_transfer_payload = (savestate_transfer_payload_t *) malloc(sizeof(savestate_transfer_payload_t) /* Fixed size header */ + COMPRESSED_DATA_WITH_REDUNDANCY_BOUND_BYTES);
-
-                int64_t remote_payload_size = 0;
-                // @todo The last packet contains some number of garbage bytes probably add the size thing back?
-                for (int i = 0; i < k; i++) {
-                    for (int j = 0; j < session->remote_packet_groups; j++) {
-                        memcpy(((uint8_t *) savestate_transfer_payload) + remote_payload_size, session->fec_packet[j][i], rs_block_size);
-                        remote_payload_size += rs_block_size;
-                    }
-                }
-
-                SAM2_LOG_INFO("Received savestate transfer payload for frame %" PRId64 "", savestate_transfer_payload->frame_counter);
-
-                if (   savestate_transfer_payload->total_size_bytes > k * (int) rs_block_size * session->remote_packet_groups
-                    || savestate_transfer_payload->total_size_bytes < 0) {
-                    SAM2_LOG_ERROR("Savestate transfer payload total size would out-of-bounds when computing hash: %" PRId64 "", savestate_transfer_payload->total_size_bytes);
-                    goto cleanup;
-                }
-
-                their_savestate_transfer_payload_xxhash = savestate_transfer_payload->xxhash;
-                savestate_transfer_payload->xxhash = 0;
-                our_savestate_transfer_payload_xxhash = ZSTD_XXH64(savestate_transfer_payload, savestate_transfer_payload->total_size_bytes, 0);
-
-                if (their_savestate_transfer_payload_xxhash != our_savestate_transfer_payload_xxhash) {
-                    SAM2_LOG_ERROR("Savestate transfer payload hash mismatch: %" PRIx64 " != %" PRIx64 "", their_savestate_transfer_payload_xxhash, our_savestate_transfer_payload_xxhash);
-                    goto cleanup;
-                }
-
-                ret = ZSTD_decompress(
-                    session->core_options, sizeof(session->core_options),
-                    savestate_transfer_payload->compressed_data + savestate_transfer_payload->compressed_savestate_size,
-                    savestate_transfer_payload->compressed_options_size
-                );
-
-                if (ZSTD_isError(ret)) {
-                    SAM2_LOG_ERROR("Error decompressing core options: %s", ZSTD_getErrorName(ret));
-                } else {
-                    session->flags |= ULNET_SESSION_FLAG_CORE_OPTIONS_DIRTY;
-                    //session.retro_run(); // Apply options before loading savestate; Lets hope this isn't necessary
-
-                    save_state_data = (unsigned char *) malloc(savestate_transfer_payload->decompressed_savestate_size);
-
-                    int64_t save_state_size = ZSTD_decompress(
-                        save_state_data,
-                        savestate_transfer_payload->decompressed_savestate_size,
-                        savestate_transfer_payload->compressed_data,
-                        savestate_transfer_payload->compressed_savestate_size
-                    );
-
-                    if (ZSTD_isError(save_state_size)) {
-                        SAM2_LOG_ERROR("Error decompressing savestate: %s", ZSTD_getErrorName(save_state_size));
-                    } else {
-                        if (!session->retro_unserialize(save_state_data, save_state_size)) {
-                            SAM2_LOG_ERROR("Failed to load savestate");
-                        } else {
-                            SAM2_LOG_DEBUG("Save state loaded");
-                            session->frame_counter = savestate_transfer_payload->frame_counter;
-                            session->room_we_are_in = savestate_transfer_payload->room;
-                        }
-                    }
-                }
-
-cleanup:
-                if (save_state_data != NULL) {
-                    free(save_state_data);
-                }
-
-                free(savestate_transfer_payload);
+        ulnet__save_state_stream_advance(session);
 
-                ulnet__reset_save_state_bookkeeping(session);
-            }
+        if (session->remote_savestate_stream_failed) {
+            ulnet__reset_save_state_bookkeeping(session);
+        } else if (ulnet__save_state_stream_done(session)) {
+            ulnet__save_state_stream_finish(session, agent, sequence_hi, sequence_lo);
+            ulnet__reset_save_state_bookkeeping(session);
         }
         break;
     }
@@ -1111,7 +2650,7 @@ ULNET_LINKAGE int ulnet_startup_ice_for_peer(ulnet_session_t *session, uint64_t
 
     config.user_ptr = (void *) session;
 
-    int p = sam2_get_port_of_peer(&session->room_we_are_in, peer_id);
+    int p = peer_id == session->relay_parent_peer_id ? SAM2_AUTHORITY_INDEX : sam2_get_port_of_peer(&session->room_we_are_in, peer_id);
     if (p == -1) {
         assert(session->spectator_count < SAM2_ARRAY_LENGTH(session->spectator_peer_ids));
         session->spectator_peer_ids[p = session->spectator_count++] = peer_id;
@@ -1167,10 +2706,11 @@ int ulnet_process_message(ulnet_session_t *session, void *response) {
         // This looks weird but really we're just figuring out what the current state of the room
         // looks like so we can generate deltas against it
         sam2_room_t future_room_we_are_in = session->room_we_are_in;
-        for (int64_t frame = session->frame_counter+1LL; frame < session->state[SAM2_AUTHORITY_INDEX].frame; frame++) {
+        // Changes on frames we ticked with predicted input haven't been applied yet
+        for (int64_t frame = session->rollback_confirmed_frame+1LL; frame < session->state[SAM2_AUTHORITY_INDEX].frame; frame++) {
             ulnet__xor_delta(
                 &future_room_we_are_in,
-                &session->state[SAM2_AUTHORITY_INDEX].room_xor_delta[frame % ULNET_DELAY_BUFFER_SIZE],
+                &session->state[SAM2_AUTHORITY_INDEX].room_xor_delta[frame % ULNET_DELAY_BUFFER_SIZE_MAX],
                 sizeof(session->room_we_are_in)
             );
         }
@@ -1248,13 +2788,39 @@ int ulnet_process_message(ulnet_session_t *session, void *response) {
             return 0;
         }
 
+        if (strncmp(room_signal->ice_sdp, ULNET_RELAY_SDP_PREFIX, strlen(ULNET_RELAY_SDP_PREFIX)) == 0) {
+            uint64_t relay_peer_id = strtoull(room_signal->ice_sdp + strlen(ULNET_RELAY_SDP_PREFIX), NULL, 16);
+
+            if (   !ulnet_is_spectator(session, session->our_peer_id)
+                || room_signal->peer_id != ulnet__peer_id_of_port(session, SAM2_AUTHORITY_INDEX)) {
+                // Whoever we connect to can redirect us once for every signal we sent them before they did
+                SAM2_LOG_DEBUG("Ignoring relay redirect from %016" PRIx64 " since we don't get input through them", room_signal->peer_id);
+            } else if (relay_peer_id <= SAM2_PORT_SENTINELS_MAX || relay_peer_id == session->our_peer_id) {
+                SAM2_LOG_WARN("Peer %016" PRIx64 " redirected us to an invalid relay %016" PRIx64, room_signal->peer_id, relay_peer_id);
+            } else {
+                SAM2_LOG_INFO("Peer %016" PRIx64 " redirected us to relay through %016" PRIx64, room_signal->peer_id, relay_peer_id);
+                ulnet__spectate_through(session, relay_peer_id);
+            }
+
+            return 0;
+        }
+
+        if (   session->relay_parent_peer_id
+            && room_signal->peer_id == session->room_we_are_in.peer_ids[SAM2_AUTHORITY_INDEX]) {
+            SAM2_LOG_DEBUG("Ignoring signal from the authority since we get input through %016" PRIx64, session->relay_parent_peer_id);
+            return 0;
+        }
+
         int p = ulnet_locate_peer(session, room_signal->peer_id);
 
         if (p == -1) {
             SAM2_LOG_INFO("Received signal from unknown peer");
 
-            if (session->our_peer_id == session->room_we_are_in.peer_ids[SAM2_AUTHORITY_INDEX]) {
-                if (session->spectator_count == ULNET_SPECTATOR_MAX) {
+            if (   session->our_peer_id == session->room_we_are_in.peer_ids[SAM2_AUTHORITY_INDEX]
+                || ulnet_is_spectator(session, session->our_peer_id) /* Relay */) {
+                if (ulnet__redirect_spectator(session, room_signal->peer_id)) {
+                    return 0;
+                } else if (session->spectator_count == ULNET_SPECTATOR_MAX) {
                     SAM2_LOG_WARN("We can't let them in as a spectator there are too many spectators");
 
                     static sam2_error_message_t error = { 
@@ -1263,7 +2829,10 @@ int ulnet_process_message(ulnet_session_t *session, void *response) {
                         "Authority has reached the maximum number of spectators"
                     };
 
+                    error.peer_id = room_signal->peer_id;
+
                     session->sam2_send_callback(session->user_ptr, (char *) &error);
+                    return 0;
                 } else {
                     SAM2_LOG_INFO("We are letting them in as a spectator");
                 }
@@ -1324,102 +2893,50 @@ int ulnet_process_message(ulnet_session_t *session, void *response) {
 }
 
 // Pass in save state since often retro_serialize can tick the core
-ULNET_LINKAGE void ulnet_send_save_state(ulnet_session_t *session, juice_agent_t *agent, void *save_state, size_t save_state_size, int64_t save_state_frame) {
+// This only copies the save state and kicks off a background job. The packets are sent over the following calls to ulnet_poll_session
+ULNET_LINKAGE int ulnet_send_save_state(ulnet_session_t *session, uint64_t peer_bitfield, void *save_state, size_t save_state_size, int64_t save_state_frame) {
     assert(save_state);
 
-    int packet_payload_size_bytes = ULNET_PACKET_SIZE_BYTES_MAX - sizeof(ulnet_save_state_packet_header_t);
-    int n, k, packet_groups;
-
-    int64_t save_state_transfer_payload_compressed_bound_size_bytes = ZSTD_COMPRESSBOUND(save_state_size) + ZSTD_COMPRESSBOUND(sizeof(session->core_options));
-    ulnet__logical_partition(sizeof(savestate_transfer_payload_t) /* Header */ + save_state_transfer_payload_compressed_bound_size_bytes,
-                      FEC_REDUNDANT_BLOCKS, &n, &k, &packet_payload_size_bytes, &packet_groups);
-
-    size_t savestate_transfer_payload_plus_parity_bound_bytes = packet_groups * n * packet_payload_size_bytes;
-
-    // This points to the savestate transfer payload, but also the remaining bytes at the end hold our parity blocks
-    // Having this data in a single contiguous buffer makes indexing easier
-    savestate_transfer_payload_t *savestate_transfer_payload = (savestate_transfer_payload_t *) malloc(savestate_transfer_payload_plus_parity_bound_bytes);
-
-    savestate_transfer_payload->decompressed_savestate_size = save_state_size;
-    savestate_transfer_payload->compressed_savestate_size = ZSTD_compress(
-        savestate_transfer_payload->compressed_data,
-        save_state_transfer_payload_compressed_bound_size_bytes,
-        save_state, save_state_size, session->zstd_compress_level
-    );
-
-    if (ZSTD_isError(savestate_transfer_payload->compressed_savestate_size)) {
-        SAM2_LOG_ERROR("ZSTD_compress failed: %s", ZSTD_getErrorName(savestate_transfer_payload->compressed_savestate_size));
-        assert(0);
-    }
-
-    savestate_transfer_payload->compressed_options_size = ZSTD_compress(
-        savestate_transfer_payload->compressed_data + savestate_transfer_payload->compressed_savestate_size,
-        save_state_transfer_payload_compressed_bound_size_bytes - savestate_transfer_payload->compressed_savestate_size,
-        session->core_options, sizeof(session->core_options), session->zstd_compress_level
-    );
-
-    if (ZSTD_isError(savestate_transfer_payload->compressed_options_size)) {
-        SAM2_LOG_ERROR("ZSTD_compress failed: %s", ZSTD_getErrorName(savestate_transfer_payload->compressed_options_size));
-        assert(0);
+    if (session->save_state_job) {
+        SAM2_LOG_WARN("Already sending a save state");
+        return -1;
     }
 
-    ulnet__logical_partition(
-        sizeof(savestate_transfer_payload_t) /* Header */ + savestate_transfer_payload->compressed_savestate_size + savestate_transfer_payload->compressed_options_size,
-        FEC_REDUNDANT_BLOCKS, &n, &k, &packet_payload_size_bytes, &packet_groups
-    );
-    assert(savestate_transfer_payload_plus_parity_bound_bytes >= packet_groups * n * packet_payload_size_bytes); // If this fails my logic calculating the bounds was just wrong
-
-    savestate_transfer_payload->frame_counter = save_state_frame;
-    savestate_transfer_payload->room = session->room_we_are_in;
-    savestate_transfer_payload->total_size_bytes = sizeof(savestate_transfer_payload_t) + savestate_transfer_payload->compressed_savestate_size + savestate_transfer_payload->compressed_options_size;
-
-    savestate_transfer_payload->xxhash = 0;
-    savestate_transfer_payload->xxhash = ZSTD_XXH64(savestate_transfer_payload, savestate_transfer_payload->total_size_bytes, 0);
-    // Create parity blocks for Reed-Solomon. n - k in total for each packet group
-    // We have "packet grouping" because pretty much every implementation of Reed-Solomon doesn't support more than 255 blocks
-    // and unfragmented UDP packets over ethernet are limited to ULNET_PACKET_SIZE_BYTES_MAX
-    // This makes the code more complicated and the error correcting properties slightly worse but it's a practical tradeoff
-    void *rs_code = fec_new(k, n);
-    for (int j = 0; j < packet_groups; j++) {
-        void *data[255];
-
-        for (int i = 0; i < n; i++) {
-            data[i] = (unsigned char *) savestate_transfer_payload + ulnet__logical_partition_offset_bytes(j, i, packet_payload_size_bytes, packet_groups);
-        }
-
-        for (int i = k; i < n; i++) {
-            fec_encode(rs_code, (void **)data, data[i], i, packet_payload_size_bytes);
+    ulnet_save_state_job_t *job = (ulnet_save_state_job_t *) calloc(1, sizeof(ulnet_save_state_job_t));
+    job->save_state = (uint8_t *) malloc(save_state_size);
+    memcpy(job->save_state, save_state, save_state_size);
+    job->save_state_size = save_state_size;
+    job->save_state_frame = save_state_frame;
+    job->room = session->room_we_are_in;
+    job->delay_buffer_size = session->delay_buffer_size;
+    job->delay_frames = session->delay_frames;
+    job->rollback_frames = session->rollback_frames;
+    memcpy(job->core_options, session->core_options, sizeof(job->core_options));
+    job->zstd_compress_level = session->zstd_compress_level;
+    job->groups_encoded = -1;
+
+    // Everyone gets the same packets so the lossiest peer decides the redundancy
+    job->redundant_blocks = FEC_REDUNDANT_BLOCKS_MIN;
+    for (int p = 0; p < SAM2_ARRAY_LENGTH(session->agent); p++) {
+        if (peer_bitfield & (1ULL << p)) {
+            job->agent[p] = session->agent[p];
+            job->redundant_blocks = SAM2_MAX(job->redundant_blocks, ulnet__fec_redundant_blocks(session->peer_packet_loss[p]));
         }
     }
-    fec_free(rs_code);
-
-    // Send original data blocks and parity blocks
-    // @todo I wrote this in such a way that you can do a zero-copy when creating the packets to send
-    for (int i = 0; i < n; i++) {
-        for (int j = 0; j < packet_groups; j++) {
-            ulnet_save_state_packet_fragment2_t packet;
-            packet.channel_and_flags = ULNET_CHANNEL_SAVESTATE_TRANSFER;
-            if (k == 239) {
-                packet.channel_and_flags |= ULNET_SAVESTATE_TRANSFER_FLAG_K_IS_239;
-                if (j == 0) {
-                    packet.channel_and_flags |= ULNET_SAVESTATE_TRANSFER_FLAG_SEQUENCE_HI_IS_0;
-                    packet.packet_groups = packet_groups;
-                } else {
-                    packet.sequence_hi = j;
-                }
-            } else {
-                packet.reed_solomon_k = k;
-            }
-
-            packet.sequence_lo = i;
+    SAM2_LOG_INFO("Sending save state with %d parity blocks per %d blocks", job->redundant_blocks, GF_SIZE);
 
-            memcpy(packet.payload, (unsigned char *) savestate_transfer_payload + ulnet__logical_partition_offset_bytes(j, i, packet_payload_size_bytes, packet_groups), packet_payload_size_bytes);
+    ulnet__mutex_init(&job->mutex);
+    job->references = 2;
+    session->save_state_job = job;
 
-            int status = juice_send(agent, (char *) &packet, sizeof(ulnet_save_state_packet_header_t) + packet_payload_size_bytes);
-            assert(status == 0);
-        }
+    if (ulnet__thread_create(&job->thread, ulnet__save_state_job_thread, job)) {
+        ulnet__thread_detach(job->thread);
+    } else {
+        SAM2_LOG_WARN("Failed to create save state thread; encoding on this one");
+        job->references = 1;
+        ulnet__save_state_job_run(job);
     }
 
-    free(savestate_transfer_payload);
+    return 0;
 }
 #endif